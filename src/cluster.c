@@ -26,6 +26,7 @@
 #include "list.h"
 #include "event.h"
 #include "cluster.h"
+#include "lazyfree.h"
 
 /* Global state store instance */
 memento instance;
@@ -43,7 +44,11 @@ void init_system(int distributed, const char *id,
 
     /* Initialize instance containers */
     instance.cluster_mode = distributed;
-    instance.store = map_create();
+    instance.store = store_create();
+    if (instance.store)
+        store_start_expiry(instance.store);
+    if (lazyfree_start(LAZYFREE_THREADS) < 0)
+        perror("ERROR lazyfree threads");
     instance.cluster = list_create();
     instance.log_level = DEBUG;
     instance.verbose = 0;
@@ -70,7 +75,7 @@ void init_system(int distributed, const char *id,
  */
 void cluster_destroy(void) {
     /* deallocate instance containers */
-    map_release(instance.store);
+    store_release(instance.store);
     list_release(instance.cluster);
     free((char *) self.name);
 }
@@ -23,7 +23,7 @@
 #ifndef CLUSTER_H
 #define CLUSTER_H
 
-#include "map.h"
+#include "store.h"
 #include "list.h"
 #include "util.h"
 #include "networking.h"
@@ -52,7 +52,7 @@ typedef struct {
 	event_loop el;					// event_loop structure, must be initialized
     unsigned int lock : 1;          // global lock, used in a cluster context
     unsigned int cluster_mode : 1;  // distributed flag
-    map *store;                     // items of the DB
+    store *store;                   // items of the DB, split in shards
     list *cluster;                  // map of cluster nodes
     loglevel log_level;             // log level of the entire system
     unsigned int verbose : 1;       // verbosity for logs
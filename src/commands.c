@@ -25,17 +25,23 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include "commands.h"
 #include "networking.h"
 #include "serializer.h"
 #include "hashing.h"
 #include "cluster.h"
+#include "store.h"
 #include "util.h"
 
 
 command command_entries[] = {
 	{"set", set_command, reply_default},
+	{"cas", cas_command, reply_default},
 	{"get", get_command, reply_data},
 	{"del", del_command, reply_default},
 	{"inc", inc_command, reply_default},
@@ -45,7 +51,16 @@ command command_entries[] = {
 	{"append", append_command, reply_default},
 	{"prepend", prepend_command, reply_default},
 	{"getp", getp_command, reply_data},
-	{"flush", flush_command, reply_default}
+	{"flush", flush_command, reply_default},
+	{"info", info_command, reply_data},
+	{"setex", setex_command, reply_default},
+	{"expire", expire_command, reply_default},
+	{"ttl", ttl_command, reply_data},
+	{"persist", persist_command, reply_default},
+	{"compact", compact_command, reply_data},
+	{"range", range_command, reply_data, 1},
+	{"prefix", prefix_command, reply_data, 1},
+	{"scan", scan_command, reply_data, 1}
 };
 
 
@@ -54,17 +69,106 @@ int commands_len(void) {
 }
 
 
+/* Longest name of a command found through the dispatch table */
+#define DISPATCH_LEN_MAX	15
+
+
+/*
+ * Commands by length and first letter of their name, every slot holds the
+ * first entry of command_entries sharing both, or -1, and the others follow
+ * through dispatch_next. Only incf and info share a slot so far, so a lookup
+ * compares the name with one or two entries at most. Built from
+ * command_entries on first use
+ */
+static int dispatch[DISPATCH_LEN_MAX + 1][26];
+static int dispatch_next[sizeof(command_entries) / sizeof(command)];
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+
+static void build_dispatch(void) {
+	memset(dispatch, -1, sizeof(dispatch));
+	/* Walk backward so that the chains keep the order of the entries */
+	for (int i = commands_len() - 1; i >= 0; i--) {
+		const char *name = command_entries[i].name;
+		size_t len = strlen(name);
+		int c = tolower((unsigned char) name[0]) - 'a';
+		if (len > DISPATCH_LEN_MAX || c < 0 || c >= 26)
+			continue;
+		dispatch_next[i] = dispatch[len][c];
+		dispatch[len][c] = i;
+	}
+}
+
+
+/*
+ * Return the command named by the first len bytes of name, ignoring case, or
+ * NULL if there's none
+ */
+const command *command_lookup(const char *name, size_t len) {
+	pthread_once(&dispatch_once, build_dispatch);
+	if (len == 0 || len > DISPATCH_LEN_MAX)
+		return NULL;
+	int c = tolower((unsigned char) name[0]) - 'a';
+	if (c < 0 || c >= 26)
+		return NULL;
+	for (int i = dispatch[len][c]; i >= 0; i = dispatch_next[i])
+		if (strncasecmp(name, command_entries[i].name, len) == 0)
+			return &command_entries[i];
+	return NULL;
+}
+
+
+#define IS_SEPARATOR(c)	((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+
+/*
+ * Move past the next argument of a request without terminating it, return
+ * its start, its length in len if not NULL, or NULL if there's none left
+ */
+static char *request_skip(request *r, size_t *len) {
+	char *p = r->pos;
+	while (IS_SEPARATOR(*p)) p++;
+	char *arg = p;
+	while (*p != '\0' && !IS_SEPARATOR(*p)) p++;
+	r->pos = p;
+	if (len) *len = p - arg;
+	return p > arg ? arg : NULL;
+}
+
+
+/*
+ * Return the next argument of a request terminated in place, its length in
+ * len if not NULL, or NULL if there's none left
+ */
+char *request_next(request *r, size_t *len) {
+	char *arg = request_skip(r, len);
+	/* The rest of the request starts right after the separator */
+	if (arg && *r->pos != '\0')
+		*r->pos++ = '\0';
+	return arg;
+}
+
+
+/*
+ * Return what's left of a request after the last argument taken and its
+ * separator, as is, or NULL if nothing is left
+ */
+char *request_rest(request *r) {
+	return *r->pos != '\0' ? r->pos : NULL;
+}
+
+
 void *reply_data(reply *rep) {
 	peer_t *p = (peer_t *) malloc(sizeof(peer_t));
 	p->fd = rep->sfd;
-	p->alloc = 0;
-	if (rep->data == NULL)
-		rep->data = S_NIL;
+	p->alloc = 1;
+	/* payload commands hand over a private copy of the data, or NULL */
+	char *data = rep->data ? (char *) rep->data : S_NIL;
 
 	if (instance.cluster_mode == 1 && rep->fp == 1) {
 	    /* adding some informations about the node host */
-	    char response[strlen((char *) rep->data) + strlen(self.addr) + strlen(self.name) + 9];
-	    sprintf(response, "%s:%s:%d> %s", self.name, self.addr, self.port, (char *) rep->data);
+	    char response[strlen(data) + strlen(self.addr) + strlen(self.name) + 9];
+	    sprintf(response, "%s:%s:%d> %s", self.name, self.addr, self.port, data);
 	    struct message m = { response, rep->rfd, 1 };
 	    char *payload = serialize(m);
 		p->data = payload;
@@ -73,12 +177,12 @@ void *reply_data(reply *rep) {
 		if (instance.verbose) DEBUG("Reply data to peer\n");
 	}
 	else {
-	 	if (instance.verbose) DEBUG("Reply data to client %s\n", rep->data);
-        rep->data = append_string(rep->data, "\r\n");
-		p->data = rep->data;
-	 	p->size = strlen(rep->data);
+	 	if (instance.verbose) DEBUG("Reply data to client %s\n", data);
+		p->data = append_string(data, "\r\n");
+	 	p->size = strlen(p->data);
 	 	p->tocli = 1;
 	}
+	free(rep->data);
 	schedule_write(p);
 	return NULL;
 }
@@ -101,6 +205,14 @@ void *reply_default(reply *rep) {
 				msg = (struct message) { S_NIL, rep->rfd, 1 };
 				len = strlen(S_NIL) + S_OFFSET;
 				break;
+			case OOM:
+				msg = (struct message) { S_OOM, rep->rfd, 1 };
+				len = strlen(S_OOM) + S_OFFSET;
+				break;
+			case MISMATCH:
+				msg = (struct message) { S_MISMATCH, rep->rfd, 1 };
+				len = strlen(S_MISMATCH) + S_OFFSET;
+				break;
 			case COMMAND_NOT_FOUND:
 				msg = (struct message) { S_UNK, rep->rfd, 1 };
 				len = strlen(S_UNK) + S_OFFSET;
@@ -129,6 +241,12 @@ void *reply_default(reply *rep) {
 			case MAP_ERR:
 				p->data = S_NIL;
 				break;
+			case OOM:
+				p->data = S_OOM;
+				break;
+			case MISMATCH:
+				p->data = S_MISMATCH;
+				break;
 			case COMMAND_NOT_FOUND:
 				p->data = S_UNK;
 				break;
@@ -150,81 +268,70 @@ void *reply_default(reply *rep) {
 }
 
 
-void execute(char *buffer, int sfd, int rfd, int fp) {
-	reply *rep = malloc(sizeof(reply));
-	rep->sfd = sfd;
-	rep->rfd = rfd;
-	rep->fp = fp;
-	char *command = strtok(buffer, " \r\n");
-    if (command) {
-        /* check if the buffer contains a valid command */
-        for (int i = 0; i < commands_len(); i++) {
-            if (strncasecmp(command, command_entries[i].name,
-                        strlen(command_entries[i].name)) == 0
-                    && strlen(command_entries[i].name) == strlen(command)) {
-				rep->data = (*command_entries[i].func)(buffer + strlen(command) + 1);
-				(*command_entries[i].callback)(rep);
-            }
-        }
-	}
-	free(rep);
+/*
+ * Hash the next argument of a request without taking it, it's the key for
+ * every command taking one. Both the routing to a partition and the lookup
+ * into the store use this single value. Return the key, or NULL if no
+ * argument is left
+ */
+static char *request_key(const request *r, unsigned long *hash) {
+	request key = *r;
+	size_t len = 0;
+	char *arg = request_skip(&key, &len);
+	*hash = key_hash(arg ? arg : key.pos, len);
+	return arg;
+}
+
+
+static unsigned long request_hash(char *buffer) {
+	request r = { buffer };
+	unsigned long hash;
+	request_skip(&r, NULL);
+	request_key(&r, &hash);
+	return hash;
 }
 
 
 /*
- * Auxiliary function used to check the command coming from clients
- * FIXME: repeated code
+ * Run a command on the arguments left in a request and hand the result to
+ * its callback
  */
-int check_command(char *buffer) {
-
-    char *command = strtok(buffer, " \r\n");
+static void run_command(const command *cmd, request *r,
+		int sfd, int rfd, int fp, unsigned long hash) {
+	reply rep = { .sfd = sfd, .rfd = rfd, .fp = fp };
+	rep.data = cmd->func(r, hash);
+	cmd->callback(&rep);
+}
 
-    if (command) {
-        // in case of 'QUIT' or 'EXIT' close the connection
-        if (strlen(command) == 4
-                && (strncasecmp(command, "quit", 4) == 0
-                    || strncasecmp(command, "exit", 4) == 0))
-            return END;
 
-		for (int i = 0; i < commands_len(); i++) {
-			if (strncasecmp(command, command_entries[i].name,
-                        strlen(command_entries[i].name)) == 0
-					&& strlen(command_entries[i].name) == strlen(command)) {
-				return 1;
-			}
-		}
-    }
-	return COMMAND_NOT_FOUND;
+void execute(char *buffer, int sfd, int rfd, int fp, unsigned long hash) {
+	request r = { buffer };
+	size_t len;
+	char *name = request_skip(&r, &len);
+	const command *cmd = name ? command_lookup(name, len) : NULL;
+	if (cmd)
+		run_command(cmd, &r, sfd, rfd, fp, hash);
 }
 
 
 /*
- * Utility function, get a valid index in the range of the cluster buckets, so
- * it is possible to route command to the correct node
+ * Utility function, get a valid index in the range of the cluster buckets from
+ * the hash of the key, so it is possible to route command to the correct node
  */
-static int hash(char *key) {
-    uint32_t seed = 65133; // initial seed for murmur hashing
-    if (key) {
-        char *holder = malloc(strlen(key));
-        strcpy(holder, key);
-        trim(holder);
-        /* retrieve an index in the bucket range */
-        int idx = murmur3_32((const uint8_t *) holder,
-                strlen(holder), seed) % PARTITIONS;
-
-        if (instance.verbose) {
-            DEBUG("Destination node: %d for key %s\r\n", idx, holder);
-        }
-        free(holder);
-        return idx;
-    } else return -1;
+static int partition(unsigned long hash) {
+    int idx = (hash >> 32) % PARTITIONS;
+    if (instance.verbose) {
+        DEBUG("Destination node: %d\r\n", idx);
+    }
+    return idx;
 }
 
 /*
  * Helper function to route command to the node into which keyspace contains
  * idx, find the node by performing a simple linear search
  */
-static void route_command(int idx, int fd, char *b, struct message *msg) {
+static void route_command(int idx, unsigned long hash,
+        int fd, char *b, struct message *msg) {
     /* Send the message serialized to the right node according the routing
        table cluster */
     list_node *cursor = instance.cluster->head;
@@ -235,7 +342,7 @@ static void route_command(int idx, int fd, char *b, struct message *msg) {
             if (n->self == 1) {
                 /* commit command directly if the range is handled by the
                    current node */
-				execute(b, fd, fd, 0);
+				execute(b, fd, fd, 0, hash);
                 break;
             } else {
                 msg->content = b;
@@ -260,148 +367,169 @@ static void route_command(int idx, int fd, char *b, struct message *msg) {
 }
 
 
-int peer_command_handler(int fd) {
-    char buf[instance.el.bufsize];
-    memset(buf, 0x00, instance.el.bufsize);
-    int ret = 0;
-
-    /* read data from file descriptor socket */
-	// TODO: need a circular buffer or something similar to handle all incoming
-	// data in a loop
-    int bytes = recv(fd, buf, instance.el.bufsize, 0);
-
-    if (bytes == -1) {
-        if (errno != EAGAIN) ret = 1;
-    }
-	else if (bytes == 0) {
-		ret = 1;
+/*
+ * Handle a serialized message received from a peer node, either the answer
+ * to a request routed to it or a request to execute
+ */
+int peer_command_handler(int fd, char *buf) {
+	peer_t *p = (peer_t *) malloc(sizeof(peer_t));
+	/* message came from a peer node, so it is serialized */
+	struct message m = deserialize(buf); // deserialize into message structure
+	p->alloc = 1;
+	p->tocli = 1;
+	p->fd = m.fd;
+	if (instance.verbose) {
+		DEBUG("Received data from peer node, message: %s\n", m.content);
 	}
-    else {
-		peer_t *p = (peer_t *) malloc(sizeof(peer_t));
-    	/* message came from a peer node, so it is serialized */
-		struct message m = deserialize(buf); // deserialize into message structure
-        p->alloc = 1;
-		p->tocli = 1;
-		p->fd = m.fd;
-	    if (instance.verbose) {
-		    DEBUG("Received data from peer node, message: %s\n", m.content);
-        }
-		if (strcmp(m.content, S_OK) == 0
-				|| strcmp(m.content, S_NIL) == 0
-				|| strcmp(m.content, S_UNK) == 0) {
-            if (instance.verbose) DEBUG("Answer to client\n");
-            p->data = m.content;
-            p->size = strlen(p->data);
-            schedule_write(p);
-		} else if (m.ready == 1) {
-            if (instance.verbose) {
-			    DEBUG("Answer to client from a query %s\n", m.content);
-            }
-            m.content = append_string(m.content, "\r\n");
-			/* answer to a query operations to the original client */
-			p->data = m.content;
-			p->size = strlen(m.content);
-			schedule_write(p);
-		} else {
-			/* message from another node */
-            if (instance.verbose) {
-			    DEBUG("Answer to another node: %s\n", m.content);
-            }
-			execute(m.content, fd, m.fd, 1);
+	if (strcmp(m.content, S_OK) == 0
+			|| strcmp(m.content, S_NIL) == 0
+			|| strcmp(m.content, S_OOM) == 0
+			|| strcmp(m.content, S_UNK) == 0
+			|| strcmp(m.content, S_MISMATCH) == 0) {
+		if (instance.verbose) DEBUG("Answer to client\n");
+		p->data = m.content;
+		p->size = strlen(p->data);
+		schedule_write(p);
+	} else if (m.ready == 1) {
+		if (instance.verbose) {
+			DEBUG("Answer to client from a query %s\n", m.content);
+		}
+		m.content = append_string(m.content, "\r\n");
+		/* answer to a query operations to the original client */
+		p->data = m.content;
+		p->size = strlen(m.content);
+		schedule_write(p);
+	} else {
+		/* message from another node */
+		if (instance.verbose) {
+			DEBUG("Answer to another node: %s\n", m.content);
 		}
+		free(p);
+		execute(m.content, fd, m.fd, 1, request_hash(m.content));
 	}
-	return ret;
+	return 0;
+}
+
+
+/*
+ * Answer a client with one of the static error replies
+ */
+static void reply_error(int fd, char *err) {
+	peer_t *p = (peer_t *) malloc(sizeof(peer_t));
+	p->fd = fd;
+	p->alloc = 0;
+	p->tocli = 1;
+	p->data = err;
+	p->size = strlen(err);
+	schedule_write(p);
 }
 
 
-int client_command_handler(int fd) {
-    struct message msg;
-    char buf[instance.el.bufsize];
-    memset(buf, 0x00, instance.el.bufsize);
-    int ret = 0;
+/*
+ * Handle a request line received from a client, without its line ending.
+ * Return END if the client asked to close the connection
+ */
+int client_command_handler(int fd, char *buf) {
+	struct message msg;
+	request r = { buf };
+	unsigned long hash;
+	size_t len;
 
-    /* read data from file descriptor socket */
-	// TODO: need a circular buffer or something similar to handle all incoming
-	// data in a loop
-    int bytes = recv(fd, buf, instance.el.bufsize, 0);
+	/* The request is left untouched until it's known where to run it */
+	char *name = request_skip(&r, &len);
+	/* in case of 'QUIT' or 'EXIT' close the connection */
+	if (name && len == 4 && (strncasecmp(name, "quit", 4) == 0
+				|| strncasecmp(name, "exit", 4) == 0))
+		return END;
 
-    if (bytes == -1) {
-        if (errno != EAGAIN) ret = 1;
-    }
-	else if (bytes == 0) {
-		ret = 1;
+	const command *cmd = name ? command_lookup(name, len) : NULL;
+	if (!cmd) {
+		/* command received is not recognized */
+		DEBUG("Unrecognized command\n");
+		reply_error(fd, S_UNK);
+		return 0;
 	}
-    else {
-		/* check the if the command is genuine */
-		char *dupstr = strdup(buf);
-		int check = check_command(dupstr);
-		free(dupstr);
-
-		if (check == 1) {
-			if (instance.cluster_mode == 1) {
-				/* message came directly from a client */
-                char *b = strdup(buf); // payload to send
-				strtok(buf, " \r\n");
-				/* command is handled and it isn't an informative one */
-				char *arg_1 = strtok(NULL, " ");
-				int idx = hash(arg_1);
-				/* route the command to the correct node */
-				route_command(idx, fd, b, &msg);
-				free(b);
-			}
-			else {
-				/* Single node instance, cluster is not enabled */
-				execute(buf, fd, fd, 0);
-			}
-		} else {
-			/* command received is not recognized or is a quit command */
-			DEBUG("Unrecognized command\n");
-			peer_t *p = (peer_t *) malloc(sizeof(peer_t));
-			switch (check) {
-				case COMMAND_NOT_FOUND:
-					p->fd = fd;
-					p->alloc = 0;
-					p->tocli = 1;
-					p->data = S_UNK;
-					p->size = strlen(S_UNK);
-					schedule_write(p);
-					break;
-				case END:
-					ret = END;
-					break;
-				default:
-					break;
-			}
-		}
+
+	/*
+	 * Keys are spread over the nodes by their own hash, a listing run on a
+	 * single node would silently miss those of the others
+	 */
+	if (cmd->local && instance.cluster_mode == 1) {
+		reply_error(fd, S_LOCAL);
+		return 0;
 	}
-	return ret;
+
+	char *arg_1 = request_key(&r, &hash);
+
+	if (instance.cluster_mode == 1) {
+		/* command is handled and it isn't an informative one */
+		int idx = arg_1 ? partition(hash) : -1;
+		/* route the command to the correct node, the payload is copied */
+		route_command(idx, hash, fd, buf, &msg);
+	}
+	else {
+		/* Single node instance, cluster is not enabled */
+		run_command(cmd, &r, fd, fd, 0, hash);
+	}
+	return 0;
 }
 
 
 /*************************** -- COMMANDS -- ***************************/
 
 
-void *set_command(char *cmd) {
+void *set_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
-    void *key = strtok(cmd, " ");
-    if (key) {
-        void *val = (char *) key + strlen(key) + 1;
-        remove_newline(val);
-        if (val) *ret = map_put(instance.store, strdup(key), strdup(val));
-    }
-    return ret;
+	*ret = MAP_ERR;
+	char *key = request_next(r, NULL);
+	char *val = request_rest(r);
+	if (key) {
+		/* the value is what follows the key, it may be empty */
+		if (val) remove_newline(val);
+		if (store_make_room(instance.store) == STORE_OOM) *ret = OOM;
+		else *ret = store_put(instance.store, key, hash, val ? val : "");
+	}
+	return ret;
 }
 
 
-void *get_command(char *cmd) {
-	void *key = strtok(cmd, " ");
-	if (key) {
-		trim(key);
-		void *val = map_get(instance.store, key);
-		if (val) {
-			return val;
-		}
+/*
+ * CAS command handler, set a key to a value only if its version is still the
+ * one read by a previous GETP, 0 meaning that the key must not exist. Reply
+ * with a version mismatch if the key was written in the meantime, so that
+ * the client can read it again and retry.
+ *
+ * Require three arguments:
+ *
+ *     CAS <key> <version> <value>
+ */
+void *cas_command(request *r, unsigned long hash) {
+	int *ret = malloc(sizeof(int));
+	*ret = MAP_ERR;
+	char *key = request_next(r, NULL);
+	char *ver = request_next(r, NULL);
+	char *val = request_rest(r);
+	if (key && ver && val) {
+		char *end;
+		errno = 0;
+		unsigned long long version = strtoull(ver, &end, 10);
+		remove_newline(val);
+		if (end == ver || *end != '\0' || *ver == '-' || errno == ERANGE)
+			*ret = MAP_ERR;
+		else if (store_make_room(instance.store) == STORE_OOM)
+			*ret = OOM;
+		else if ((*ret = store_cas(instance.store, key, hash, version, val))
+				== MAP_MISMATCH)
+			*ret = MISMATCH;
 	}
+	return ret;
+}
+
+
+void *get_command(request *r, unsigned long hash) {
+	char *key = request_next(r, NULL);
+	if (key)
+		return store_get(instance.store, key, hash);
 	return NULL;
 }
 
@@ -414,22 +542,47 @@ void *get_command(char *cmd) {
  *
  *     DEL <key>
  */
-void *del_command(char *cmd) {
+void *del_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
+	size_t len;
+	char *key = request_next(r, NULL);
 	while (key) {
-		trim(key);
-		*ret = map_del(instance.store, key);
-		key = strtok(NULL, " ");
+		*ret = store_del(instance.store, key, hash);
+		key = request_next(r, &len);
+		/* only the first key was hashed with the request */
+		if (key) hash = key_hash(key, len);
 	}
     return ret;
 }
 
 
+/*
+ * Parse the optional amount of INC and DEC, 1 if it's missing. Return -1 if
+ * it's not a valid 64 bit integer
+ */
+static int parse_step(char *arg, int64_t *by) {
+	*by = 1;
+	if (!arg) return 0;
+	return parse_int64(arg, by) ? 0 : -1;
+}
+
+
+/*
+ * Parse the optional amount of INCF and DECF, 1.0 if it's missing. Return -1
+ * if it's not a valid number
+ */
+static int parse_stepf(char *arg, double *by) {
+	*by = 1.0;
+	if (!arg) return 0;
+	return parse_double(arg, by) ? 0 : -1;
+}
+
+
 /*
  * INC command handler, increment (add 1) to the integer value to it if
- * present, return MAP_ERR reply code otherwise.
+ * present, return MAP_ERR reply code otherwise. The value is stored as a 64
+ * bit integer from the first increment on and rendered as text when read.
  *
  * Requires at least one arguments, but also accept optionally the amount to be
  * added to the specified key:
@@ -437,25 +590,13 @@ void *del_command(char *cmd) {
  *     INC <key>   // +1 to <key>
  *     INC <key> 5 // +5 to <key>
  */
-void *inc_command(char *cmd) {
+void *inc_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
-	if (key) {
-		trim(key);
-		void *val = map_get(instance.store, key);
-		if (val) {
-			char *s = (char *) val;
-			if (ISINT(s) == 1) {
-				int v = GETINT(s);
-				char *by = strtok(NULL, " ");
-				if (by && ISINT(by)) {
-					v += GETINT(by);
-				} else v++;
-				sprintf(val, "%d\n", v);
-				*ret = MAP_OK;
-			}
-		}
+	char *key = request_next(r, NULL);
+	int64_t by;
+	if (key && parse_step(request_next(r, NULL), &by) == 0) {
+		*ret = store_incr(instance.store, key, hash, by);
 	}
     return ret;
 }
@@ -471,25 +612,13 @@ void *inc_command(char *cmd) {
  *     INCF <key>     // +1.0 to <key>
  *     INCF <key> 5.0 // +5.0 to <key>
  */
-void *incf_command(char *cmd) {
+void *incf_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
-	if (key) {
-		trim(key);
-		void *val = map_get(instance.store, key);
-		if (val) {
-			char *s = (char *) val;
-			if (is_float(s) == 1) {
-				double v = GETDOUBLE(s);
-				char *by = strtok(NULL, " ");
-				if (by && is_float(by)) {
-					v += GETDOUBLE(by);
-				} else v += 1.0;
-				sprintf(val, "%lf\n", v);
-				*ret = MAP_OK;
-			}
-		}
+	char *key = request_next(r, NULL);
+	double by;
+	if (key && parse_stepf(request_next(r, NULL), &by) == 0) {
+		*ret = store_incrf(instance.store, key, hash, by);
 	}
     return ret;
 }
@@ -505,26 +634,14 @@ void *incf_command(char *cmd) {
  *     DEC <key>   // -1 to <key>
  *     DEC <key> 5 // -5 to <key>
  */
-void *dec_command(char *cmd) {
+void *dec_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
-	if (key) {
-		trim(key);
-		void *val = map_get(instance.store, key);
-		if (val) {
-			char *s = (char *) val;
-			if(ISINT(s) == 1) {
-				int v = GETINT(s);
-				char *by = strtok(NULL, " ");
-				if (by != NULL && ISINT(by)) {
-					v -= GETINT(by);
-				} else v--;
-				sprintf(val, "%d\n", v);
-				*ret = MAP_OK;
-			}
-		}
-    }
+	char *key = request_next(r, NULL);
+	int64_t by;
+	if (key && parse_step(request_next(r, NULL), &by) == 0 && by != INT64_MIN) {
+		*ret = store_incr(instance.store, key, hash, -by);
+	}
     return ret;
 }
 
@@ -539,26 +656,14 @@ void *dec_command(char *cmd) {
  *     DECF <key>     // -1.0 to <key>
  *     DECF <key> 5.0 // -5.0 to <key>
  */
-void *decf_command(char *cmd) {
+void *decf_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
-	if (key) {
-		trim(key);
-		void *val = map_get(instance.store, key);
-		if (val) {
-			char *s = (char *) val;
-			if(is_float(s) == 1) {
-				double v = GETDOUBLE(s);
-				char *by = strtok(NULL, " ");
-				if (by != NULL && ISINT(by)) {
-					v -= GETDOUBLE(by);
-				} else v -= 1.0;
-				sprintf(val, "%lf\n", v);
-				*ret = MAP_OK;
-			}
-        }
-    }
+	char *key = request_next(r, NULL);
+	double by;
+	if (key && parse_stepf(request_next(r, NULL), &by) == 0) {
+		*ret = store_incrf(instance.store, key, hash, -by);
+	}
     return ret;
 }
 
@@ -571,20 +676,33 @@ void *decf_command(char *cmd) {
  *
  *     APPEND <key> <value>
  */
-void *append_command(char *cmd) {
+void *append_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
-	void *val = (char *) key + strlen(key) + 1;
+	char *key = request_next(r, NULL);
+	char *val = request_rest(r);
 	if (key && val) {
-		char *key_holder = strdup(key);
-		char *val_holder = strdup(val);
-		void *_val = map_get(instance.store, key_holder);
-		if (_val) {
-			remove_newline(_val);
-			char *append = append_string(_val, val_holder);
-			*ret = map_put(instance.store, key_holder, append);
+		remove_newline(val);
+		if (store_make_room(instance.store) == STORE_OOM) {
+			*ret = OOM;
+			return ret;
 		}
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_WRLOCK(sh);
+		map_entry *e = map_get_entry_hashed(sh->map, key, hash);
+		if (e) {
+			char *_val = map_entry_value(e);
+			long expire_time = e->has_expire_time
+				? map_entry_meta(sh->map, e)->expire_time : -1;
+			char *append = append_string(_val, val);
+			free(_val);
+			*ret = map_put_hashed(sh->map, key, hash, append);
+			/* appending doesn't reset the TTL of the key */
+			if (*ret == MAP_OK && expire_time >= 0)
+				map_set_expire_hashed(sh->map, key, hash, expire_time);
+			free(append);
+		}
+		SHARD_UNLOCK(sh);
 	}
     return ret;
 }
@@ -599,20 +717,33 @@ void *append_command(char *cmd) {
  *
  *     PREPEND <key> <value>
  */
-void *prepend_command(char *cmd) {
+void *prepend_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
 	*ret = MAP_ERR;
-	void *key = strtok(cmd, " ");
-	void *val = (char *) key + strlen(key) + 1;
+	char *key = request_next(r, NULL);
+	char *val = request_rest(r);
 	if (key && val) {
-		char *key_holder = strdup(key);
-		char *val_holder = strdup(val);
-		void *_val = map_get(instance.store, key_holder);
-		if (_val) {
-			remove_newline(val_holder);
-			char *append = append_string(val_holder, _val);
-			*ret = map_put(instance.store, key_holder, append);
+		remove_newline(val);
+		if (store_make_room(instance.store) == STORE_OOM) {
+			*ret = OOM;
+			return ret;
+		}
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_WRLOCK(sh);
+		map_entry *e = map_get_entry_hashed(sh->map, key, hash);
+		if (e) {
+			char *_val = map_entry_value(e);
+			long expire_time = e->has_expire_time
+				? map_entry_meta(sh->map, e)->expire_time : -1;
+			char *append = append_string(val, _val);
+			free(_val);
+			*ret = map_put_hashed(sh->map, key, hash, append);
+			/* prepending doesn't reset the TTL of the key */
+			if (*ret == MAP_OK && expire_time >= 0)
+				map_set_expire_hashed(sh->map, key, hash, expire_time);
+			free(append);
 		}
+		SHARD_UNLOCK(sh);
 	}
     return ret;
 }
@@ -627,44 +758,326 @@ void *prepend_command(char *cmd) {
  *
  *     GETP <key>
  */
-void *getp_command(char *cmd) {
-	void *key = strtok(cmd, " ");
+void *getp_command(request *r, unsigned long hash) {
+	char *key = request_next(r, NULL);
 	if (key) {
-		trim(key);
-		map_entry *kv = map_get_entry(instance.store, key);
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_RDLOCK(sh);
+		map_entry *kv = map_get_entry_hashed(sh->map, key, hash);
 		if (kv) {
+			char *val = map_entry_value(kv);
 			size_t kvstrsize = strlen(kv->key)
-				+ strlen((char *) kv->val) + (sizeof(long) * 2) + 128;
+				+ strlen(val) + (sizeof(long) * 2) + 128;
 			char *kvstring = malloc(kvstrsize); // long numbers
+			map_meta *meta = map_entry_meta(sh->map, kv);
 			/* check if expire time is set */
 			char expire_time[19];
 			if (kv->has_expire_time)
-				sprintf(expire_time, "%ld\n", kv->expire_time / 1000);
+				sprintf(expire_time, "%ld\n", meta->expire_time / 1000);
 			else
 				sprintf(expire_time, "%d\n", -1);
 
 			/* format answer */
-			sprintf(kvstring, "key: %s\nvalue: %screation_time: %ld\nexpire_time: %s",
-					(char *) kv->key, (char *) kv->val, kv->creation_time, expire_time);
+			sprintf(kvstring, "key: %s\nvalue: %s\nversion: %" PRIu64
+					"\ncreation_time: %ld\nexpire_time: %s",
+					(char *) kv->key, val,
+					__atomic_load_n(&meta->version, __ATOMIC_RELAXED),
+					meta->creation_time, expire_time);
+			SHARD_UNLOCK(sh);
+			free(val);
 			return kvstring;
 		}
+		SHARD_UNLOCK(sh);
     }
     return NULL;
 }
 
 
 /*
- * FLUSH command handler, delete the entire keyspace.
+ * FLUSH command handler, delete the entire keyspace. Reply out of memory,
+ * keeping every key, if the emptied tables can't be allocated.
  *
  * Doesn't require any argument.
  */
-void *flush_command(char *cmd) {
+void *flush_command(request *r, unsigned long hash) {
 	int *ret = malloc(sizeof(int));
-    if (instance.store != NULL) {
-        map_release(instance.store);
-        instance.store = NULL;
-        instance.store = map_create();
-    }
 	*ret = OK;
+	if (instance.store != NULL && store_flush(instance.store) == STORE_OOM)
+		*ret = OOM;
     return ret;
 }
+
+
+/*
+ * INFO command handler, report the memory used by the store against its limit,
+ * the number of evicted keys and the utilization of every slab class in use.
+ *
+ * Doesn't require any argument.
+ */
+void *info_command(request *r, unsigned long hash) {
+	return store_info(instance.store);
+}
+
+
+/*
+ * COMPACT command handler, shrink the tables of the store to fit the keys left
+ * and release the memory pages no longer in use, reply with the number of
+ * bytes given back to the system.
+ *
+ * Doesn't require any argument.
+ */
+void *compact_command(request *r, unsigned long hash) {
+	char *reply = malloc(24);
+	snprintf(reply, 24, "%zu", store_compact(instance.store));
+	return reply;
+}
+
+
+/*
+ * Parse the optional max number of keys of a range query, 0 if it's missing
+ * meaning no limit. Return -1 if it's not a valid number
+ */
+static int parse_limit(char *arg, unsigned long *limit) {
+	*limit = 0;
+	if (!arg) return 0;
+	int64_t n;
+	if (!parse_int64(arg, &n) || n < 0) return -1;
+	*limit = n;
+	return 0;
+}
+
+
+/*
+ * Join the keys returned by a range query in a single reply, one per line,
+ * releasing them. Return NULL if there's none
+ */
+static char *join_keys(char **keys, unsigned long n) {
+	size_t len = 1;
+	for (unsigned long i = 0; i < n; i++)
+		len += strlen(keys[i]) + 1;
+	char *reply = n > 0 ? malloc(len) : NULL;
+	char *p = reply;
+	for (unsigned long i = 0; i < n; i++) {
+		if (reply) {
+			size_t klen = strlen(keys[i]);
+			memcpy(p, keys[i], klen);
+			p += klen;
+			*p++ = i + 1 < n ? '\n' : '\0';
+		}
+		free(keys[i]);
+	}
+	free(keys);
+	return reply;
+}
+
+
+/*
+ * RANGE command handler, list in lexicographic order the keys between two
+ * bounds, both included, served by the ordered index of the store. NULL
+ * reply if there's none or the index is disabled.
+ *
+ * Require two arguments, and accept optionally the max number of keys:
+ *
+ *     RANGE <from> <to> [count]
+ */
+void *range_command(request *r, unsigned long hash) {
+	char *from = request_next(r, NULL);
+	char *to = request_next(r, NULL);
+	unsigned long limit, n;
+	if (!from || !to) return NULL;
+	if (parse_limit(request_next(r, NULL), &limit) < 0) return NULL;
+	char **keys = store_keys(instance.store, from, to, NULL, limit, &n);
+	return join_keys(keys, n);
+}
+
+
+/*
+ * PREFIX command handler, list in lexicographic order the keys starting with
+ * a prefix, served by the ordered index of the store. NULL reply if there's
+ * none or the index is disabled.
+ *
+ * Require one argument, and accept optionally the max number of keys:
+ *
+ *     PREFIX <prefix> [count]
+ */
+void *prefix_command(request *r, unsigned long hash) {
+	char *prefix = request_next(r, NULL);
+	unsigned long limit, n;
+	if (!prefix) return NULL;
+	if (parse_limit(request_next(r, NULL), &limit) < 0) return NULL;
+	char **keys = store_keys(instance.store, prefix, NULL, prefix, limit, &n);
+	return join_keys(keys, n);
+}
+
+
+/*
+ * SCAN command handler, walk the keyspace incrementally. Every call visits a
+ * few buckets and returns the cursor to pass to the next one on the first
+ * line, followed by the keys found one per line, until the cursor returned
+ * is 0. Keys present for the whole scan are returned at least once, even if
+ * tables are resized in the meantime, but may be returned more than once.
+ * A glob pattern filters the keys returned, and COUNT hints how many keys
+ * to collect per call, 10 by default. NULL reply on invalid arguments.
+ *
+ * Require the cursor, 0 to start a new scan:
+ *
+ *     SCAN <cursor> [MATCH <pattern>] [COUNT <count>]
+ */
+void *scan_command(request *r, unsigned long hash) {
+	char *arg = request_next(r, NULL), *opt, *end, *pattern = NULL;
+	unsigned long count = 10, n;
+	if (!arg) return NULL;
+	errno = 0;
+	unsigned long cursor = strtoul(arg, &end, 10);
+	if (end == arg || *end != '\0' || *arg == '-' || errno == ERANGE)
+		return NULL;
+	while ((opt = request_next(r, NULL)) != NULL) {
+		arg = request_next(r, NULL);
+		if (!arg) return NULL;
+		if (strcasecmp(opt, "match") == 0)
+			pattern = arg;
+		else if (strcasecmp(opt, "count") != 0
+				|| parse_limit(arg, &count) < 0 || count == 0)
+			return NULL;
+	}
+	char **keys;
+	cursor = store_scan(instance.store, cursor, pattern, count, &keys, &n);
+	char *list = join_keys(keys, n);
+	size_t len = 24 + (list ? strlen(list) + 1 : 0);
+	char *reply = malloc(len);
+	snprintf(reply, len, list ? "%lu\n%s" : "%lu", cursor, list);
+	free(list);
+	return reply;
+}
+
+
+/*
+ * Parse a number of seconds argument, return -1 if it's not a valid integer
+ * or if the deadline it sets from now can't be represented in milliseconds
+ */
+static int parse_seconds(char *arg, long *secs) {
+	if (!arg) return -1;
+	char *end;
+	errno = 0;
+	*secs = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno == ERANGE) return -1;
+	if (*secs > (LONG_MAX - current_timestamp()) / 1000) return -1;
+	return 0;
+}
+
+
+/*
+ * Set the TTL of a key already locked by the caller, a non positive number of
+ * seconds deletes it right away
+ */
+static int expire_key(shard *sh, char *key, unsigned long hash, long secs) {
+	if (secs <= 0)
+		return map_del_hashed(sh->map, key, hash);
+	return map_set_expire_hashed(sh->map, key, hash,
+			current_timestamp() + secs * 1000);
+}
+
+
+/*
+ * SETEX command handler, set a key to a value that expires after a number of
+ * seconds, return MAP_ERR reply code if the arguments are not valid.
+ *
+ * Require three arguments:
+ *
+ *     SETEX <key> <seconds> <value>
+ */
+void *setex_command(request *r, unsigned long hash) {
+	int *ret = malloc(sizeof(int));
+	*ret = MAP_ERR;
+	char *key = request_next(r, NULL);
+	char *secs_arg = request_next(r, NULL);
+	char *val = request_rest(r);
+	long secs;
+	if (key && val && parse_seconds(secs_arg, &secs) == 0) {
+		remove_newline(val);
+		if (store_make_room(instance.store) == STORE_OOM) {
+			*ret = OOM;
+			return ret;
+		}
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_WRLOCK(sh);
+		*ret = map_put_hashed(sh->map, key, hash, val);
+		if (*ret == MAP_OK)
+			*ret = expire_key(sh, key, hash, secs);
+		SHARD_UNLOCK(sh);
+	}
+	return ret;
+}
+
+
+/*
+ * EXPIRE command handler, set a key to expire after a number of seconds,
+ * return MAP_ERR reply code if the key is not present.
+ *
+ * Require two arguments:
+ *
+ *     EXPIRE <key> <seconds>
+ */
+void *expire_command(request *r, unsigned long hash) {
+	int *ret = malloc(sizeof(int));
+	*ret = MAP_ERR;
+	char *key = request_next(r, NULL);
+	long secs;
+	if (key && parse_seconds(request_next(r, NULL), &secs) == 0) {
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_WRLOCK(sh);
+		*ret = expire_key(sh, key, hash, secs);
+		SHARD_UNLOCK(sh);
+	}
+	return ret;
+}
+
+
+/*
+ * TTL command handler, return the seconds left before a key expires, -1 if
+ * the key has no TTL and -2 if it doesn't exist.
+ *
+ * Require one argument:
+ *
+ *     TTL <key>
+ */
+void *ttl_command(request *r, unsigned long hash) {
+	char *key = request_next(r, NULL);
+	long ttl = -2;
+	if (key) {
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_RDLOCK(sh);
+		map_entry *kv = map_get_entry_hashed(sh->map, key, hash);
+		if (kv && kv->has_expire_time)
+			ttl = (map_entry_meta(sh->map, kv)->expire_time
+					- current_timestamp() + 999) / 1000;
+		else if (kv)
+			ttl = -1;
+		SHARD_UNLOCK(sh);
+	}
+	char *reply = malloc(24);
+	snprintf(reply, 24, "%ld", ttl);
+	return reply;
+}
+
+
+/*
+ * PERSIST command handler, remove the TTL of a key, return MAP_ERR reply code
+ * if the key is not present.
+ *
+ * Require one argument:
+ *
+ *     PERSIST <key>
+ */
+void *persist_command(request *r, unsigned long hash) {
+	int *ret = malloc(sizeof(int));
+	*ret = MAP_ERR;
+	char *key = request_next(r, NULL);
+	if (key) {
+		shard *sh = store_shard(instance.store, hash);
+		SHARD_WRLOCK(sh);
+		*ret = map_set_expire_hashed(sh->map, key, hash, -1);
+		SHARD_UNLOCK(sh);
+	}
+	return ret;
+}
@@ -30,11 +30,13 @@
 #define S_OK    "OK\r\n"
 #define S_NIL   "(null)\r\n"
 #define S_OOM   "(Out of memory)\r\n"
+#define S_MISMATCH  "(Version mismatch)\r\n"
 #define S_UNK   "(Unknown command)\r\n"
+#define S_LOCAL "(Not supported in cluster mode)\r\n"
 
 
 typedef enum { OK, PAYLOAD_OK, ITERATE_OK,
-    MISSING, FULL, OOM, COMMAND_NOT_FOUND, END} reply_code;
+    MISSING, FULL, OOM, MISMATCH, COMMAND_NOT_FOUND, END} reply_code;
 
 
 typedef struct {
@@ -46,29 +48,52 @@ typedef struct {
 } reply;
 
 
+/*
+ * Cursor over the arguments of a request, every thread parses its own
+ * requests with one. Arguments are cut out of the request in place, each one
+ * is terminated where its separator was, so nothing is copied
+ */
+typedef struct {
+	char *pos;				/* next byte to parse */
+} request;
+
+
 typedef struct {
 	char *name;						/* name of the command */
-	void *(*func)(char *);			/* command implementation function */
+	void *(*func)(request *, unsigned long);	/* command implementation function */
 	void *(*callback)(reply *);		/* callback handler function for result */
+	unsigned int local : 1;			/* sees only the keys of the node running it */
 } command;
 
 
 void *reply_default(reply *);
 void *reply_data(reply *);
-int check_command(char *);
-int peer_command_handler(int);
-int client_command_handler(int);
+char *request_next(request *, size_t *);
+char *request_rest(request *);
+const command *command_lookup(const char *, size_t);
+int peer_command_handler(int, char *);
+int client_command_handler(int, char *);
 
-void *set_command(char *);
-void *get_command(char *);
-void *del_command(char *);
-void *inc_command(char *);
-void *dec_command(char *);
-void *incf_command(char *);
-void *decf_command(char *);
-void *getp_command(char *);
-void *append_command(char *);
-void *prepend_command(char *);
-void *flush_command(char *);
+void *set_command(request *, unsigned long);
+void *cas_command(request *, unsigned long);
+void *get_command(request *, unsigned long);
+void *del_command(request *, unsigned long);
+void *inc_command(request *, unsigned long);
+void *dec_command(request *, unsigned long);
+void *incf_command(request *, unsigned long);
+void *decf_command(request *, unsigned long);
+void *getp_command(request *, unsigned long);
+void *append_command(request *, unsigned long);
+void *prepend_command(request *, unsigned long);
+void *flush_command(request *, unsigned long);
+void *info_command(request *, unsigned long);
+void *setex_command(request *, unsigned long);
+void *expire_command(request *, unsigned long);
+void *ttl_command(request *, unsigned long);
+void *persist_command(request *, unsigned long);
+void *compact_command(request *, unsigned long);
+void *range_command(request *, unsigned long);
+void *prefix_command(request *, unsigned long);
+void *scan_command(request *, unsigned long);
 
 #endif
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include "epoch.h"
+
+
+/* Max number of threads inside an epoch at the same time */
+#define EPOCH_MAX_THREADS   256
+
+/* Epoch of a thread that is not reading */
+#define EPOCH_IDLE          ULONG_MAX
+
+/* Retired memory is reclaimed every time this many pointers pile up */
+#define EPOCH_BATCH         64
+
+
+/*
+ * Epoch pinned by a reading thread, every slot sits in its own cache line so
+ * that pinning never contends with the other readers
+ */
+typedef struct {
+    unsigned long epoch;
+    int used;
+} __attribute__((aligned(64))) epoch_slot;
+
+
+typedef struct {
+    void *ptr;
+    epoch_free_fn free_fn;
+    unsigned long epoch;
+} epoch_retired;
+
+
+/*
+ * State of a thread: the slot it pins, how deep it entered and the memory it
+ * retired, in order of epoch
+ */
+typedef struct {
+    int slot;
+    unsigned int depth;
+    int reclaiming;
+    epoch_retired *retired;
+    size_t len;
+    size_t cap;
+    size_t reclaim_at;
+} epoch_thread;
+
+
+static epoch_slot slots[EPOCH_MAX_THREADS];
+/* Highest number of slots ever taken, the ones past it need no scan */
+static unsigned int nslots;
+static unsigned long global_epoch = 1;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static __thread epoch_thread self = { .slot = -1 };
+
+
+/*
+ * Release the memory left retired by an exiting thread and its slot
+ */
+static void epoch_thread_exit(void *arg) {
+    epoch_barrier();
+    free(self.retired);
+    self.retired = NULL;
+    self.len = self.cap = 0;
+    if (self.slot >= 0) {
+        __atomic_store_n(&slots[self.slot].epoch, EPOCH_IDLE, __ATOMIC_RELEASE);
+        __atomic_store_n(&slots[self.slot].used, 0, __ATOMIC_RELEASE);
+        self.slot = -1;
+    }
+}
+
+
+static void epoch_init(void) {
+    pthread_key_create(&exit_key, epoch_thread_exit);
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++)
+        slots[i].epoch = EPOCH_IDLE;
+}
+
+
+/*
+ * Take a free slot for the calling thread, return -1 if all are in use
+ */
+static int epoch_register(void) {
+    pthread_once(&exit_once, epoch_init);
+
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        int unused = 0;
+        if (__atomic_load_n(&slots[i].used, __ATOMIC_RELAXED) == 0
+                && __atomic_compare_exchange_n(&slots[i].used, &unused, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            unsigned int n = __atomic_load_n(&nslots, __ATOMIC_RELAXED);
+            while (n < (unsigned int) i + 1
+                    && !__atomic_compare_exchange_n(&nslots, &n, i + 1, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                ;
+            self.slot = i;
+            pthread_setspecific(exit_key, &self);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Pin the current epoch before reading shared memory without a lock, calls
+ * can be nested. Return -1 if the thread couldn't get a slot, the caller must
+ * then read under a lock
+ */
+int epoch_enter(void) {
+    if (self.slot < 0 && epoch_register() < 0)
+        return -1;
+    if (self.depth++ == 0) {
+        epoch_slot *slot = &slots[self.slot];
+        __atomic_store_n(&slot->epoch,
+                __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        /* The pin must be visible before any read of the shared memory */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+
+/*
+ * Leave the epoch entered by the last epoch_enter
+ */
+void epoch_exit(void) {
+    if (--self.depth == 0)
+        __atomic_store_n(&slots[self.slot].epoch, EPOCH_IDLE, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return the oldest epoch still pinned, after moving the global epoch on so
+ * that readers entering from now on don't hold back what's retired so far
+ */
+static unsigned long epoch_oldest(void) {
+    unsigned long oldest = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    unsigned int n = __atomic_load_n(&nslots, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned long e = __atomic_load_n(&slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (e < oldest) oldest = e;
+    }
+    return oldest;
+}
+
+
+/*
+ * Free the memory retired by the calling thread that no reader can still
+ * reach, the one retired before the oldest epoch pinned
+ */
+void epoch_reclaim(void) {
+    if (self.len == 0 || self.reclaiming) return;
+
+    unsigned long oldest = epoch_oldest();
+    size_t n = 0;
+    while (n < self.len && self.retired[n].epoch < oldest)
+        n++;
+
+    /* Memory retired by the free functions themselves is appended */
+    self.reclaiming = 1;
+    for (size_t i = 0; i < n; i++)
+        self.retired[i].free_fn(self.retired[i].ptr);
+    self.reclaiming = 0;
+
+    self.len -= n;
+    memmove(self.retired, self.retired + n, self.len * sizeof(epoch_retired));
+    self.reclaim_at = self.len + EPOCH_BATCH;
+}
+
+
+/*
+ * Free ptr with free_fn once no reader may still hold it, the caller must
+ * have already unlinked it from any structure readers can reach
+ */
+void epoch_retire(void *ptr, epoch_free_fn free_fn) {
+    if (!ptr) return;
+
+    if (self.len == self.cap) {
+        /* Retired memory is released when the thread exits */
+        if (self.cap == 0) {
+            pthread_once(&exit_once, epoch_init);
+            pthread_setspecific(exit_key, &self);
+        }
+        size_t cap = self.cap ? self.cap * 2 : EPOCH_BATCH * 2;
+        epoch_retired *retired = realloc(self.retired, cap * sizeof(epoch_retired));
+        if (!retired) {
+            /* No room to defer it, wait for the readers instead */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+            while (epoch_oldest() <= epoch)
+                sched_yield();
+            free_fn(ptr);
+            return;
+        }
+        self.retired = retired;
+        self.cap = cap;
+    }
+
+    /* The unlink must be visible before the epoch is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    self.retired[self.len].ptr = ptr;
+    self.retired[self.len].free_fn = free_fn;
+    self.retired[self.len].epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    self.len++;
+
+    if (self.len >= EPOCH_BATCH && self.len >= self.reclaim_at)
+        epoch_reclaim();
+}
+
+
+/*
+ * Wait until all the memory retired by the calling thread is freed, it must
+ * not be inside an epoch itself
+ */
+void epoch_barrier(void) {
+    while (self.len > 0) {
+        epoch_reclaim();
+        if (self.len > 0)
+            sched_yield();
+    }
+}
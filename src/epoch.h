@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+
+/*
+ * Epoch-based reclamation. Readers running without any lock pin the current
+ * epoch for the duration of a read, memory unlinked by writers is retired
+ * instead of freed and only released once every reader pinned at the time of
+ * its retirement has left. Every thread keeps its own list of retired memory
+ */
+
+typedef void (*epoch_free_fn)(void *);
+
+
+/* Epoch API */
+int epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *, epoch_free_fn);
+void epoch_reclaim(void);
+void epoch_barrier(void);
+
+#endif
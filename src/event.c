@@ -35,4 +35,22 @@ void set_epollin(int efd, int fd) {
     }
 }
 
+void add_epollet(int efd, int fd) {
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl(2): add epollet");
+    }
+}
 
+void kick_epollet(int efd, int fd) {
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        perror("epoll_ctl(2): kick epollet");
+    }
+}
@@ -4,10 +4,14 @@
 #define ADD_FD(efd, fd) add_epollin(efd, fd)
 #define SET_FD_OUT(efd, fd, data) set_epollout(efd, fd, data)
 #define SET_FD_IN(efd, fd) set_epollin(efd, fd)
+#define ADD_FD_ET(efd, fd) add_epollet(efd, fd)
+#define KICK_FD(efd, fd) kick_epollet(efd, fd)
 
 
 void add_epollin(int, int);
 void set_epollout(int, int, void*);
 void set_epollin(int, int);
+void add_epollet(int, int);
+void kick_epollet(int, int);
 
 #endif
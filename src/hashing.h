@@ -31,7 +31,7 @@
 /*
  * Basic hasing function, uses CRC32
  */
-int _hash(char *keystring) {
+static inline int _hash(char *keystring) {
 
     unsigned long key = CRC32((unsigned char *) (keystring), strlen(keystring));
 
@@ -55,7 +55,7 @@ int _hash(char *keystring) {
 /*
  * Jenkins hash function
  */
-uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, size_t length) {
+static inline uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, size_t length) {
     size_t i = 0;
     uint32_t hash = 0;
     while (i != length) {
@@ -73,7 +73,7 @@ uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, size_t length) {
 /*
  * Murmur 3 function, should be initialized using a random seed
  */
-uint32_t murmur3_32(const uint8_t *key, size_t len, uint32_t seed) {
+static inline uint32_t murmur3_32(const uint8_t *key, size_t len, uint32_t seed) {
     uint32_t h = seed;
     if (len > 3) {
         const uint32_t *key_x4 = (const uint32_t *) key;
@@ -111,5 +111,113 @@ uint32_t murmur3_32(const uint8_t *key, size_t len, uint32_t seed) {
     return h;
 }
 
+/*
+ * Seed of the key hash, every node of a cluster must use the same one as
+ * the partition of a key is derived from its hash
+ */
+#define KEY_SEED    0x6d656d656e746fULL
+
+
+#define XXH_P1  0x9E3779B185EBCA87ULL
+#define XXH_P2  0xC2B2AE3D27D4EB4FULL
+#define XXH_P3  0x165667B19E3779F9ULL
+#define XXH_P4  0x85EBCA77C2B2AE63ULL
+#define XXH_P5  0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static inline uint64_t xxh64_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline uint32_t xxh64_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_P1;
+}
+
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+
+/*
+ * xxHash64, consumes 8 bytes at a time and spreads every input bit over the
+ * whole result, so any slice of it can be used as an index
+ */
+static inline uint64_t xxh64(const void *input, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *) input;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        do {
+            v1 = xxh64_round(v1, xxh64_read64(p));
+            v2 = xxh64_round(v2, xxh64_read64(p + 8));
+            v3 = xxh64_round(v3, xxh64_read64(p + 16));
+            v4 = xxh64_round(v4, xxh64_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+
+    h += (uint64_t) len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) xxh64_read32(p) * XXH_P1;
+        h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_P5;
+        h = ROTL64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+/*
+ * The hash of a key, computed once per request and then sliced by every
+ * layer: the low bits index the slots of a map, bits 32-44 select the
+ * cluster partition, bits 48-56 the store shard and the top 7 bits are the
+ * tag stored in the control byte of the slot
+ */
+static inline uint64_t key_hash(const char *key, size_t len) {
+    return xxh64(key, len, KEY_SEED);
+}
+
 
 #endif
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "lazyfree.h"
+
+
+/* Max number of background threads freeing memory */
+#define LAZYFREE_MAX_THREADS    8
+
+
+typedef struct lazyfree_job {
+    void *ptr;
+    lazyfree_fn free_fn;
+    struct lazyfree_job *next;
+} lazyfree_job;
+
+
+/*
+ * Jobs wait in a FIFO guarded by a single mutex, they are few and large so
+ * the queue is never contended. Pending counts the jobs queued or running
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static lazyfree_job *head, *tail;
+static unsigned long pending;
+static pthread_t threads[LAZYFREE_MAX_THREADS];
+static unsigned int nthreads;
+static int stopping;
+
+
+static void *lazyfree_loop(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!head && !stopping)
+            pthread_cond_wait(&work, &lock);
+        if (!head) break;
+
+        lazyfree_job *job = head;
+        head = job->next;
+        if (!head) tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        job->free_fn(job->ptr);
+        free(job);
+
+        pthread_mutex_lock(&lock);
+        if (--pending == 0)
+            pthread_cond_broadcast(&idle);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+
+/*
+ * Start n background threads, capped to LAZYFREE_MAX_THREADS, independent
+ * jobs like the maps of different shards are freed in parallel. Return -1
+ * if no thread could be started
+ */
+int lazyfree_start(unsigned int n) {
+    if (n > LAZYFREE_MAX_THREADS) n = LAZYFREE_MAX_THREADS;
+    pthread_mutex_lock(&lock);
+    stopping = 0;
+    while (nthreads < n) {
+        if (pthread_create(&threads[nthreads], NULL, lazyfree_loop, NULL) != 0)
+            break;
+        nthreads++;
+    }
+    pthread_mutex_unlock(&lock);
+    return nthreads > 0 ? 0 : -1;
+}
+
+
+/*
+ * Run the jobs left and stop the background threads
+ */
+void lazyfree_stop(void) {
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work);
+    unsigned int n = nthreads;
+    pthread_mutex_unlock(&lock);
+
+    for (unsigned int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_lock(&lock);
+    nthreads = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Have ptr released by free_fn on a background thread, or right away if
+ * there's none running
+ */
+void lazyfree_submit(void *ptr, lazyfree_fn free_fn) {
+    if (!ptr) return;
+
+    lazyfree_job *job = malloc(sizeof(lazyfree_job));
+    pthread_mutex_lock(&lock);
+    if (!job || nthreads == 0 || stopping) {
+        pthread_mutex_unlock(&lock);
+        free(job);
+        free_fn(ptr);
+        return;
+    }
+    job->ptr = ptr;
+    job->free_fn = free_fn;
+    job->next = NULL;
+    if (tail) tail->next = job;
+    else head = job;
+    tail = job;
+    pending++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Wait until every job submitted so far has been run
+ */
+void lazyfree_wait(void) {
+    pthread_mutex_lock(&lock);
+    while (pending > 0)
+        pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Return the number of jobs queued or running
+ */
+unsigned long lazyfree_pending(void) {
+    pthread_mutex_lock(&lock);
+    unsigned long n = pending;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef LAZYFREE_H
+#define LAZYFREE_H
+
+
+/* Background threads started by the server */
+#define LAZYFREE_THREADS    2
+
+
+/*
+ * Lazy freeing. Structures that are expensive to release, like whole maps
+ * swapped out by FLUSH or very large values, are handed to a small pool of
+ * background threads so that the worker serving the request replies right
+ * away. Jobs submitted before the pool is started, or when it can't take
+ * them, are run by the caller
+ */
+
+typedef void (*lazyfree_fn)(void *);
+
+
+/* Lazyfree API */
+int lazyfree_start(unsigned int);
+void lazyfree_stop(void);
+void lazyfree_submit(void *, lazyfree_fn);
+void lazyfree_wait(void);
+unsigned long lazyfree_pending(void);
+
+#endif
@@ -23,56 +23,533 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "map.h"
+#include "slab.h"
+#include "epoch.h"
+#include "lazyfree.h"
+#include "numa.h"
+#include "hashing.h"
 #include "util.h"
 
 
+/* Table sizes are always a power of 2 */
 const unsigned int INITIAL_SIZE = 256;
-const unsigned int MAX_CHAIN_LENGTH = 8;
+/* Maximum percentage of full slots */
+const unsigned int MAX_LOAD = 75;
+/* Below this percentage of full slots the table shrinks */
+const unsigned int MIN_LOAD = 10;
+/* Number of slots of the old table migrated by every write operation */
+const unsigned int REHASH_STEP = 16;
+/* Drained memory of the old table is given back in chunks of this size */
+const unsigned long REHASH_RELEASE = 64 * 1024;
+/* Higher values make the access counter grow slower with hits */
+const unsigned int LFU_LOG_FACTOR = 10;
+/* The access counter is decremented once for every minute of idle time */
+const unsigned int LFU_DECAY_SECONDS = 60;
+/* Max slots visited to find the entries of a sample */
+const unsigned int SAMPLE_SCAN = 256;
+/* Values at least this large are unmapped by the lazyfree threads */
+const size_t LAZYFREE_VALUE_MIN = SLAB_PAGE_SIZE;
+/* Tables at least this large are mapped directly and backed by huge pages */
+const size_t TABLE_MMAP_MIN = 2 * 1024 * 1024;
+
+/* Size of the huge pages backing the tables mapped directly */
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+/* Room before every table, keeping the length of its mapping */
+#define TABLE_HEADER        64
+
+
+/* Coarse clock for entries access, updated by map_clock_tick */
+static uint32_t access_clock;
+
+/* Bytes taken by the tables of all maps */
+static size_t tables_memory;
+
+/* Set to map large tables on reserved huge pages first, see map_huge_pages */
+static int hugetlb;
+
+
+/* The top 7 bits of an hash are stored in the control byte of its slot */
+#define H2(hash) ((int8_t) ((hash) >> 57))
 
 
 /*
- * Hashing function for a string
+ * Return a bitmask of the slots of the group starting at ctrl whose control
+ * byte is equal to tag, 16 slots are compared with a single SSE2 instruction
  */
-static unsigned int hashmap_hash_int(map *m, char *keystr) {
+static inline unsigned int group_match(const int8_t *ctrl, int8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (ctrl[i] == tag) mask |= 1U << i;
+    return mask;
+#endif
+}
 
-    unsigned long key = CRC32((unsigned char *) (keystr), strlen(keystr));
 
-    /* Robert Jenkins' 32 bit Mix Function */
-    key += (key << 12);
-    key ^= (key >> 22);
-    key += (key << 4);
-    key ^= (key >> 9);
-    key += (key << 10);
-    key ^= (key >> 2);
-    key += (key << 7);
-    key ^= (key >> 12);
+/*
+ * Set the control byte of a slot, the first GROUP_WIDTH bytes are mirrored
+ * after the end of the array so that a group can be loaded from any position
+ */
+static inline void set_ctrl(int8_t *ctrl, unsigned long table_size,
+        unsigned long i, int8_t c) {
+    ctrl[i] = c;
+    if (i < GROUP_WIDTH) ctrl[table_size + i] = c;
+}
 
-    /* Knuth's Multiplicative Method */
-    key = (key >> 3) * 2654435761;
 
-    return key % m->table_size;
+/*
+ * Map len bytes aligned to a huge page and ask for them to be backed by
+ * transparent huge pages, a larger region is mapped and trimmed to align it
+ */
+static char *table_map_aligned(size_t len) {
+    char *p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    char *aligned = (char *) (((uintptr_t) p + HUGE_PAGE_SIZE - 1)
+            & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    munmap(aligned + len, p + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+    return aligned;
 }
 
 
 /*
- * Return the integer of the location in entries to store the point to the item,
- * or MAP_FULL.
+ * Return size bytes for the control bytes or the entries of a table. Small
+ * ones come from malloc, large ones are mapped on their own so that a random
+ * probe costs a single TLB entry every 2MB instead of every 4KB: on reserved
+ * huge pages if enabled and some are left, on transparent ones otherwise,
+ * preferably on the given NUMA node if not negative. The length of the
+ * mapping is kept right before the table
  */
-static int hashmap_hash(map *in, void *key) {
-    /* If full, return immediately */
-    if (in->size >= (in->table_size / 2)) return MAP_FULL;
-    /* Find the best index */
-    int curr = hashmap_hash_int(in, key);
-    /* Linear probing */
-    for(int i = 0; i < MAX_CHAIN_LENGTH; i++){
-        if (in->entries[curr].in_use == 0)
-            return curr;
+static void *table_alloc(size_t size, int node) {
+    size_t len = TABLE_HEADER + size;
+    char *p = NULL;
+
+    if (len < TABLE_MMAP_MIN) {
+        p = malloc(len);
+        if (!p) return NULL;
+        *(size_t *) p = 0;
+        return p + TABLE_HEADER;
+    }
+
+    len = (len + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    if (__atomic_load_n(&hugetlb, __ATOMIC_RELAXED)) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        /* The pool is exhausted, don't pay for a failing call every time */
+        if (p == MAP_FAILED) {
+            __atomic_store_n(&hugetlb, 0, __ATOMIC_RELAXED);
+            p = NULL;
+        }
+    }
+#endif
+    if (!p) p = table_map_aligned(len);
+    if (!p) return NULL;
+    /* Before any page is touched, so they all come from the node */
+    numa_bind(p, len, node);
+    *(size_t *) p = len;
+    return p + TABLE_HEADER;
+}
+
+
+static void table_free(void *table) {
+    if (!table) return;
+    char *p = (char *) table - TABLE_HEADER;
+    size_t len = *(size_t *) p;
+    if (len == 0)
+        free(p);
+    else
+        munmap(p, len);
+}
+
+
+/* Bytes taken by a table, control bytes and metadata included */
+#define TABLE_BYTES(size) \
+    ((size) * (sizeof(map_entry) + sizeof(map_meta) + 1) + GROUP_WIDTH)
+
+
+/*
+ * Allocate the control bytes, the entries and the metadata of a table, all
+ * slots empty
+ */
+static int hashmap_alloc(unsigned long table_size, int node,
+        int8_t **ctrl, map_entry **entries, map_meta **meta) {
+    *ctrl = table_alloc(table_size + GROUP_WIDTH, node);
+    *entries = table_alloc(table_size * sizeof(map_entry), node);
+    *meta = table_alloc(table_size * sizeof(map_meta), node);
+    if (!*ctrl || !*entries || !*meta) {
+        table_free(*ctrl);
+        table_free(*entries);
+        table_free(*meta);
+        return MAP_ERR;
+    }
+    memset(*ctrl, CTRL_EMPTY, table_size + GROUP_WIDTH);
+    __atomic_add_fetch(&tables_memory, TABLE_BYTES(table_size), __ATOMIC_RELAXED);
+    return MAP_OK;
+}
+
+
+static void hashmap_free_table(unsigned long table_size,
+        int8_t *ctrl, map_entry *entries, map_meta *meta) {
+    if (!ctrl) return;
+    __atomic_sub_fetch(&tables_memory, TABLE_BYTES(table_size), __ATOMIC_RELAXED);
+    table_free(ctrl);
+    table_free(entries);
+    table_free(meta);
+}
+
+
+/*
+ * Free a table replaced by a rehash, once no lock-free reader can be
+ * probing it anymore
+ */
+static void hashmap_retire_table(unsigned long table_size,
+        int8_t *ctrl, map_entry *entries, map_meta *meta) {
+    __atomic_sub_fetch(&tables_memory, TABLE_BYTES(table_size), __ATOMIC_RELAXED);
+    epoch_retire(ctrl, table_free);
+    epoch_retire(entries, table_free);
+    epoch_retire(meta, table_free);
+}
+
+
+/*
+ * Map the large tables allocated from now on on the huge pages reserved by
+ * the system (vm.nr_hugepages) when enabled, tables fall back to transparent
+ * huge pages once none are left
+ */
+void map_huge_pages(int enabled) {
+    __atomic_store_n(&hugetlb, enabled, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Update the access clock read by the entries, called periodically so that
+ * lookups never need to read the time
+ */
+void map_clock_tick(void) {
+    __atomic_store_n(&access_clock,
+            (uint32_t) time(NULL) & ACCESS_CLOCK_MASK, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Return the bytes taken by the tables of all maps, keys and values aside
+ */
+size_t map_tables_memory(void) {
+    return __atomic_load_n(&tables_memory, __ATOMIC_RELAXED);
+}
+
+
+static inline unsigned long access_idle(uint32_t access) {
+    uint32_t now = __atomic_load_n(&access_clock, __ATOMIC_RELAXED);
+    return (now - (access >> 8)) & ACCESS_CLOCK_MASK;
+}
+
+
+/* Access counter decayed by the idle time since the last access */
+static inline unsigned int access_freq(uint32_t access) {
+    unsigned long decay = access_idle(access) / LFU_DECAY_SECONDS;
+    unsigned int freq = access & 0xFF;
+    return decay >= freq ? 0 : freq - decay;
+}
+
+
+/* xorshift64*, a cheap per-thread generator for the access counter */
+static inline uint64_t access_rand(void) {
+    static __thread uint64_t state;
+    if (!state) state = (uintptr_t) &state | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * Record an access to an entry. The counter grows logarithmically, every hit
+ * is less likely to increase it than the previous one, so 8 bits are enough
+ * to tell hot keys apart. Lookups run under a shared lock, the word is only
+ * written when it changes, with a single store
+ */
+static inline void entry_touch(map_entry *e) {
+    uint32_t access = __atomic_load_n(&e->access, __ATOMIC_RELAXED);
+    unsigned int freq = access_freq(access);
+    if (freq < 255) {
+        unsigned int base = freq > LFU_INIT ? freq - LFU_INIT : 0;
+        if (access_rand() % (base * LFU_LOG_FACTOR + 1) == 0) freq++;
+    }
+    uint32_t now = __atomic_load_n(&access_clock, __ATOMIC_RELAXED);
+    uint32_t touched = (now << 8) | freq;
+    if (touched != access)
+        __atomic_store_n(&e->access, touched, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Return the seconds elapsed since the last access to an entry
+ */
+unsigned long map_entry_idle(const map_entry *e) {
+    return access_idle(e->access);
+}
+
+
+/*
+ * Return the access counter of an entry, decayed by its idle time
+ */
+unsigned int map_entry_freq(const map_entry *e) {
+    return access_freq(e->access);
+}
 
-        if (in->entries[curr].in_use == 1 && (strcmp(in->entries[curr].key, key) == 0))
-            return curr;
 
-        curr = (curr + 1) % in->table_size;
+/*
+ * Check if an entry holds a key, the cached hash and length discard almost all
+ * mismatches before touching the key memory
+ */
+static inline int entry_match(map_entry *e, const char *key,
+        size_t klen, unsigned long hash) {
+    return e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0;
+}
+
+
+/*
+ * Find the metadata of an entry of either table, it sits at the same index
+ * in the metadata array
+ */
+static inline map_meta *entry_meta(map *m, const map_entry *e) {
+    if (e >= m->entries && e < m->entries + m->table_size)
+        return &m->meta[e - m->entries];
+    return &m->old_meta[e - m->old_entries];
+}
+
+
+/*
+ * Check if the time to live of an entry has elapsed, the metadata and the
+ * clock are only read for entries that have one
+ */
+static inline int entry_expired(map *m, const map_entry *e) {
+    return e->has_expire_time && entry_meta(m, e)->expire_time <= current_timestamp();
+}
+
+
+/*
+ * Store a copy of key and value into an entry, short values share a single
+ * allocation with the key, longer ones spill to their own
+ */
+static int entry_set(map_entry *e, const char *key,
+        size_t klen, const char *val) {
+    size_t vlen = strlen(val);
+    char *k, *v;
+
+    if (vlen < EMBED_VAL_MAX) {
+        k = slab_alloc(klen + vlen + 2);
+        if (!k) return MAP_ERR;
+        v = k + klen + 1;
+    } else {
+        k = slab_alloc(klen + 1);
+        v = slab_alloc(vlen + 1);
+        if (!k || !v) {
+            slab_free(k);
+            slab_free(v);
+            return MAP_ERR;
+        }
+    }
+
+    memcpy(k, key, klen + 1);
+    memcpy(v, val, vlen + 1);
+    e->key = k;
+    e->val = v;
+    e->klen = klen;
+    e->type = VAL_STR;
+    e->embedded = vlen < EMBED_VAL_MAX;
+    return MAP_OK;
+}
+
+
+/*
+ * Store a copy of key and a number into an entry, the 8 bytes of the number
+ * follow the key aligned so that they can be updated atomically
+ */
+static int entry_set_number(map_entry *e, const char *key,
+        size_t klen, int type, uint64_t bits) {
+    size_t offset = (klen + 1 + 7) & ~(size_t) 7;
+    char *k = slab_alloc(offset + sizeof(uint64_t));
+    if (!k) return MAP_ERR;
+
+    memcpy(k, key, klen + 1);
+    memcpy(k + offset, &bits, sizeof(uint64_t));
+    e->key = k;
+    e->val = k + offset;
+    e->klen = klen;
+    e->type = type;
+    e->embedded = 1;
+    return MAP_OK;
+}
+
+
+/*
+ * Render a number value as text into buf, holding NUMBER_TEXT_LEN bytes.
+ * Doubles get the shortest of 15 or 17 digits that reads back the same
+ */
+static void number_format(int type, const void *val, char *buf) {
+    uint64_t bits = __atomic_load_n((const uint64_t *) val, __ATOMIC_RELAXED);
+    if (type == VAL_INT) {
+        snprintf(buf, NUMBER_TEXT_LEN, "%" PRId64, (int64_t) bits);
+        return;
+    }
+    double d;
+    memcpy(&d, &bits, sizeof(double));
+    snprintf(buf, NUMBER_TEXT_LEN, "%.15g", d);
+    if (strtod(buf, NULL) != d)
+        snprintf(buf, NUMBER_TEXT_LEN, "%.17g", d);
+}
+
+
+/*
+ * Release the memory of an entry, embedded values go with their key
+ */
+static void entry_free(map_entry *e) {
+    slab_free(e->key);
+    if (!e->embedded)
+        slab_free(e->val);
+}
+
+
+/* Unmapping a very large value takes a while, it's left to lazyfree */
+static void value_free_lazy(void *val) {
+    lazyfree_submit(val, slab_free);
+}
+
+
+/*
+ * Release a spilled value no longer reachable, lock-free readers may still be
+ * copying it
+ */
+static void value_retire(char *val) {
+    epoch_retire(val, slab_usable_size(val) >= LAZYFREE_VALUE_MIN
+            ? value_free_lazy : slab_free);
+}
+
+
+/*
+ * Release the memory of an entry removed from a live map
+ */
+static void entry_retire(map_entry *e) {
+    epoch_retire(e->key, slab_free);
+    if (!e->embedded)
+        value_retire(e->val);
+}
+
+
+/*
+ * Replace the value of an entry, avoiding any allocation when the new value
+ * fits in the room already available. Values rewritten in place may be torn
+ * for a lock-free reader, which then retries as the map changed under it
+ */
+static int entry_update(map_entry *e, const char *val) {
+    size_t vlen = strlen(val);
+
+    if (e->type == VAL_STR && e->embedded) {
+        size_t room = slab_usable_size(e->key) - e->klen - 1;
+        if (vlen < room) {
+            memcpy(e->val, val, vlen + 1);
+            return MAP_OK;
+        }
+    } else if (e->type == VAL_STR && vlen >= EMBED_VAL_MAX) {
+        if (vlen < slab_usable_size(e->val)) {
+            memcpy(e->val, val, vlen + 1);
+            return MAP_OK;
+        }
+        char *v = slab_alloc(vlen + 1);
+        if (!v) return MAP_ERR;
+        memcpy(v, val, vlen + 1);
+        /* A large value is still released off the hot path */
+        value_retire(e->val);
+        e->val = v;
+        return MAP_OK;
+    }
+
+    /* Switching between embedded and spilled value, or a number turning
+     * back into text, rebuild the pair */
+    map_entry old = *e;
+    if (entry_set(e, old.key, old.klen, val) == MAP_ERR)
+        return MAP_ERR;
+    entry_retire(&old);
+    return MAP_OK;
+}
+
+
+/*
+ * Return the slot holding key in a table, or MAP_ERR. Only entries whose tag
+ * matches the hash are compared, the probe ends at the first empty slot
+ */
+static long hashmap_lookup(int8_t *ctrl, map_entry *entries,
+        unsigned long table_size, const char *key, size_t klen,
+        unsigned long hash) {
+    unsigned long mask = table_size - 1;
+    unsigned long pos = hash & mask;
+    int8_t tag = H2(hash);
+
+    for (unsigned long probed = 0; probed < table_size; probed += GROUP_WIDTH) {
+        unsigned int match = group_match(ctrl + pos, tag);
+        unsigned int empty = group_match(ctrl + pos, CTRL_EMPTY);
+        /* Slots past the first empty one are not part of the sequence */
+        if (empty) match &= (empty & -empty) - 1;
+        while (match) {
+            unsigned long i = (pos + __builtin_ctz(match)) & mask;
+            if (entry_match(&entries[i], key, klen, hash))
+                return i;
+            match &= match - 1;
+        }
+        if (empty) break;
+        pos = (pos + GROUP_WIDTH) & mask;
+    }
+    /* Not found */
+    return MAP_ERR;
+}
+
+
+/*
+ * Return the slot of the current table holding key, or the first free slot of
+ * its probe sequence if not present.
+ */
+static long hashmap_hash(map *in, const char *key,
+        size_t klen, unsigned long hash) {
+    unsigned long mask = in->table_size - 1;
+    unsigned long pos = hash & mask;
+    int8_t tag = H2(hash);
+
+    for (unsigned long probed = 0; probed < in->table_size; probed += GROUP_WIDTH) {
+        unsigned int match = group_match(in->ctrl + pos, tag);
+        unsigned int empty = group_match(in->ctrl + pos, CTRL_EMPTY);
+        if (empty) match &= (empty & -empty) - 1;
+        while (match) {
+            unsigned long i = (pos + __builtin_ctz(match)) & mask;
+            if (entry_match(&in->entries[i], key, klen, hash))
+                return i;
+            match &= match - 1;
+        }
+        if (empty)
+            return (pos + __builtin_ctz(empty)) & mask;
+        pos = (pos + GROUP_WIDTH) & mask;
     }
 
     return MAP_FULL;
@@ -80,41 +557,207 @@ static int hashmap_hash(map *in, void *key) {
 
 
 /*
- * Doubles the size of the hashmap, and rehashes all the elements
+ * Return the first free slot for an hash, the key must not be in the table
  */
-static int hashmap_rehash(map *m) {
-    unsigned long old_size;
-    map_entry *curr;
+static unsigned long hashmap_free_slot(int8_t *ctrl,
+        unsigned long table_size, unsigned long hash) {
+    unsigned long mask = table_size - 1;
+    unsigned long pos = hash & mask;
+    unsigned int empty;
 
-    /* Setup the new elements */
-    map_entry *temp = calloc(2 * m->table_size, sizeof(map_entry));
-    if (!temp) return MAP_ERR;
+    while ((empty = group_match(ctrl + pos, CTRL_EMPTY)) == 0)
+        pos = (pos + GROUP_WIDTH) & mask;
 
-    /* Update the array */
-    curr = m->entries;
-    m->entries = temp;
+    return (pos + __builtin_ctz(empty)) & mask;
+}
 
-    /* Update the size */
-    old_size = m->table_size;
-    m->table_size = 2 * m->table_size;
-    m->size = 0;
 
-    /* Rehash the elements */
-    for(unsigned long i = 0; i < old_size; i++) {
-        int status;
+/*
+ * Empty a slot with backward-shift deletion: the following entries of the
+ * same cluster that may sit closer to their home slot are moved back into
+ * the hole, so probe sequences never cross an empty slot and no tombstone is
+ * ever left behind
+ */
+static void hashmap_remove_slot(int8_t *ctrl, map_entry *entries,
+        map_meta *meta, unsigned long table_size, unsigned long i) {
+    unsigned long mask = table_size - 1;
+    unsigned long j = i;
 
-        if (curr[i].in_use == 0)
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!CTRL_FULL(ctrl[j])) break;
+        /* An entry whose home lies between the hole and itself can't move */
+        unsigned long displacement = (j - (entries[j].hash & mask)) & mask;
+        if (displacement < ((j - i) & mask))
             continue;
+        entries[i] = entries[j];
+        meta[i] = meta[j];
+        set_ctrl(ctrl, table_size, i, ctrl[j]);
+        i = j;
+    }
+
+    set_ctrl(ctrl, table_size, i, CTRL_EMPTY);
+}
+
 
-        status = map_put(m, curr[i].key, curr[i].val);
-        if (status != MAP_OK)
-            return status;
+/*
+ * Find a key looking first in the current table and then, while a rehash is
+ * in progress, in the old one
+ */
+static map_entry *hashmap_find(map *m, const char *key, unsigned long hash) {
+    size_t klen = strlen(key);
+    long i = hashmap_lookup(m->ctrl, m->entries, m->table_size, key, klen, hash);
+    if (i >= 0)
+        return &m->entries[i];
+    if (m->old_entries) {
+        i = hashmap_lookup(m->old_ctrl, m->old_entries,
+                m->old_table_size, key, klen, hash);
+        if (i >= 0)
+            return &m->old_entries[i];
     }
-    free(curr);
+    return NULL;
+}
+
+
+/*
+ * Free the entry in slot i of the current or the old table and remove it
+ */
+static void hashmap_delete(map *m, int old, unsigned long i) {
+    map_entry *e = old ? &m->old_entries[i] : &m->entries[i];
+    if (e->has_expire_time) m->expires--;
+    if (m->index) skiplist_delete(m->index, e->key, e->klen);
+    entry_retire(e);
+    if (old)
+        hashmap_remove_slot(m->old_ctrl, m->old_entries, m->old_meta,
+                m->old_table_size, i);
+    else
+        hashmap_remove_slot(m->ctrl, m->entries, m->meta, m->table_size, i);
+    m->size--;
+}
+
+
+/*
+ * Check if the current table reached the maximum load
+ */
+static int hashmap_overloaded(map *m) {
+    return m->size * 100 >= m->table_size * MAX_LOAD;
+}
+
+
+/*
+ * Return to the OS the pages of an array of the old table already drained
+ * between two slots, so that the final free doesn't have to unmap the whole
+ * table at once
+ */
+static void hashmap_release_drained(void *array, size_t width,
+        unsigned long from, unsigned long to) {
+    unsigned long chunk_from = from * width / REHASH_RELEASE;
+    unsigned long chunk_to = to * width / REHASH_RELEASE;
+    if (chunk_to == chunk_from) return;
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t) array;
+    uintptr_t lo = (base + chunk_from * REHASH_RELEASE + page - 1) & ~(page - 1);
+    uintptr_t hi = (base + chunk_to * REHASH_RELEASE) & ~(page - 1);
+    if (hi > lo)
+        madvise((void *) lo, hi - lo, MADV_DONTNEED);
+}
+
+
+/*
+ * Do at most steps units of work on the old table, either moving an entry to
+ * the current one or skipping an empty slot, releasing the old table once it
+ * has been completely drained. Moving an entry out shifts the rest of its
+ * cluster back, so a slot is only skipped when nothing is left to move into
+ * it, and every slot before rehash_idx stays empty for good
+ */
+static void hashmap_rehash_step(map *m, unsigned long steps) {
+    unsigned long start = m->rehash_idx;
+
+    for (; steps > 0 && m->rehash_idx < m->old_table_size; steps--) {
+        if (!CTRL_FULL(m->old_ctrl[m->rehash_idx])) {
+            m->rehash_idx++;
+            continue;
+        }
+
+        map_entry *e = &m->old_entries[m->rehash_idx];
+        unsigned long i = hashmap_free_slot(m->ctrl, m->table_size, e->hash);
+        set_ctrl(m->ctrl, m->table_size, i, H2(e->hash));
+        m->entries[i] = *e;
+        m->meta[i] = m->old_meta[m->rehash_idx];
+        hashmap_remove_slot(m->old_ctrl, m->old_entries, m->old_meta,
+                m->old_table_size, m->rehash_idx);
+    }
+
+    hashmap_release_drained(m->old_entries, sizeof(map_entry),
+            start, m->rehash_idx);
+    hashmap_release_drained(m->old_meta, sizeof(map_meta),
+            start, m->rehash_idx);
+
+    if (m->rehash_idx == m->old_table_size) {
+        hashmap_retire_table(m->old_table_size, m->old_ctrl,
+                m->old_entries, m->old_meta);
+        m->old_ctrl = NULL;
+        m->old_entries = NULL;
+        m->old_meta = NULL;
+        m->old_table_size = 0;
+        m->rehash_idx = 0;
+    }
+}
+
+
+/*
+ * Start an incremental rehash: a new table of table_size slots becomes the
+ * current one, where all new keys go, while the old table is drained a few
+ * slots at a time by every following write operation. The new table may be
+ * larger or smaller than the old one
+ */
+static int hashmap_rehash(map *m, unsigned long table_size) {
+    /* Setup the new elements */
+    int8_t *ctrl;
+    map_entry *entries;
+    map_meta *meta;
+    if (hashmap_alloc(table_size, m->node, &ctrl, &entries, &meta) == MAP_ERR)
+        return MAP_ERR;
+
+    m->old_ctrl = m->ctrl;
+    m->old_entries = m->entries;
+    m->old_meta = m->meta;
+    m->old_table_size = m->table_size;
+    m->rehash_idx = 0;
+    m->ctrl = ctrl;
+    m->entries = entries;
+    m->meta = meta;
+    m->table_size = table_size;
+
     return MAP_OK;
 }
 
 
+/*
+ * Return the smallest table size holding the keys of a map at half of the
+ * maximum load, so that it can grow a while before resizing again
+ */
+static unsigned long hashmap_fit_size(map *m) {
+    unsigned long table_size = INITIAL_SIZE;
+    while (m->size * 200 >= table_size * MAX_LOAD)
+        table_size *= 2;
+    return table_size;
+}
+
+
+/*
+ * Start shrinking the table when the keys left after deletions fill less
+ * than MIN_LOAD of it, the entries migrate incrementally like when growing
+ */
+static void hashmap_shrink(map *m) {
+    if (m->old_entries || m->table_size <= INITIAL_SIZE
+            || m->size * 100 >= m->table_size * MIN_LOAD)
+        return;
+    hashmap_rehash(m, hashmap_fit_size(m));
+}
+
+
 /*
  * Return an empty hashmap, or NULL on failure. The newly create hashmap is
  * dynamically allocated on the heap memory, so it must be released manually.
@@ -123,60 +766,115 @@ map *map_create(void) {
     map *m = shb_malloc(sizeof(map));
     if(!m) return NULL;
 
-    m->entries = (map_entry *) calloc(INITIAL_SIZE, sizeof(map_entry));
-    if(!m->entries) {
-        if (m) map_release(m);
+    if (!__atomic_load_n(&access_clock, __ATOMIC_RELAXED))
+        map_clock_tick();
+
+    if (hashmap_alloc(INITIAL_SIZE, -1,
+                &m->ctrl, &m->entries, &m->meta) == MAP_ERR) {
+        free(m);
         return NULL;
     }
 
     m->table_size = INITIAL_SIZE;
     m->size = 0;
+    m->old_ctrl = NULL;
+    m->old_entries = NULL;
+    m->old_meta = NULL;
+    m->old_table_size = 0;
+    m->rehash_idx = 0;
+    m->expires = 0;
+    m->index = NULL;
+    m->version = 0;
+    m->node = -1;
 
     return m;
 }
 
 
 /*
- * Add a pointer to the hashmap with some key
+ * Set key to val, both are copied into the map
  */
-int map_put(map *m, void *key, void *val) {
-    /* Find a place to put our value */
-    int index = hashmap_hash(m, key);
-    while(index == MAP_FULL){
-        if (hashmap_rehash(m) == MAP_ERR) return MAP_ERR;
-        index = hashmap_hash(m, key);
+int map_put(map *m, const char *key, const char *val) {
+    return map_put_hashed(m, key, key_hash(key, strlen(key)), val);
+}
+
+
+/*
+ * Set key to val given the hash of key, callers that already hashed the key
+ * to route the request don't pay for it twice
+ */
+int map_put_hashed(map *m, const char *key, unsigned long hash, const char *val) {
+    size_t klen = strlen(key);
+    map_entry *e = NULL;
+
+    if (m->old_entries) {
+        hashmap_rehash_step(m, REHASH_STEP);
+        /* A key not yet migrated is updated where it is */
+        if (m->old_entries) {
+            long i = hashmap_lookup(m->old_ctrl, m->old_entries,
+                    m->old_table_size, key, klen, hash);
+            if (i >= 0) e = &m->old_entries[i];
+        }
     }
-    /* Set the entries */
-    m->entries[index].val = val;
-    m->entries[index].key = key;
-    if (m->entries[index].in_use == 0) {
-        m->entries[index].in_use = 1;
-        m->entries[index].has_expire_time = 0;
-        m->entries[index].expire_time = -1;
-        m->entries[index].creation_time = current_timestamp();
-        m->size++;
+
+    if (!e) {
+        if (hashmap_overloaded(m)) {
+            /* The previous rehash couldn't keep up, complete it at once */
+            if (m->old_entries)
+                hashmap_rehash_step(m, m->old_table_size * 2);
+            if (hashmap_rehash(m, m->table_size * 2) == MAP_ERR
+                    && hashmap_overloaded(m))
+                return MAP_ERR;
+        }
+        /* Find a place to put our value */
+        long index = hashmap_hash(m, key, klen, hash);
+        if (index < 0) return MAP_ERR;
+        e = &m->entries[index];
+        if (!CTRL_FULL(m->ctrl[index])) {
+            if (entry_set(e, key, klen, val) == MAP_ERR)
+                return MAP_ERR;
+            if (m->index
+                    && skiplist_insert(m->index, key, klen, hash) == MAP_ERR) {
+                entry_free(e);
+                return MAP_ERR;
+            }
+            set_ctrl(m->ctrl, m->table_size, index, H2(hash));
+            e->hash = hash;
+            e->has_expire_time = 0;
+            e->access = (__atomic_load_n(&access_clock, __ATOMIC_RELAXED) << 8)
+                | LFU_INIT;
+            map_meta *meta = &m->meta[index];
+            meta->expire_time = -1;
+            meta->creation_time = current_timestamp();
+            meta->version = ++m->version;
+            m->size++;
+            return MAP_OK;
+        }
     }
 
+    /* Setting a value starts over the life of the key, without a TTL */
+    map_meta *meta = entry_meta(m, e);
+    if (entry_expired(m, e))
+        meta->creation_time = current_timestamp();
+    if (e->has_expire_time) {
+        e->has_expire_time = 0;
+        meta->expire_time = -1;
+        m->expires--;
+    }
+    entry_touch(e);
+    if (entry_update(e, val) == MAP_ERR)
+        return MAP_ERR;
+    meta->version = ++m->version;
     return MAP_OK;
 }
 
 
 /*
- * Get your pointer out of the hashmap with a key
+ * Get your pointer out of the hashmap with a key. Lookups never advance a
+ * rehash, they may run concurrently under a shared lock
  */
 void *map_get(map *m, void *key) {
-    /* Find data location */
-    int curr = hashmap_hash_int(m, key);
-    /* Linear probing, if necessary */
-    for(int i = 0; i < MAX_CHAIN_LENGTH; i++){
-        if (m->entries[curr].in_use == 1) {
-            if (strcmp(m->entries[curr].key, key) == 0)
-                return (m->entries[curr].val);
-        }
-        curr = (curr + 1) % m->table_size;
-    }
-    /* Not found */
-    return NULL;
+    return map_get_hashed(m, key, key_hash(key, strlen(key)));
 }
 
 
@@ -184,20 +882,316 @@ void *map_get(map *m, void *key) {
  * Return the key-value pair represented by a key in the map
  */
 map_entry *map_get_entry(map *m, void *key) {
-    /* Find data location */
-    int curr = hashmap_hash_int(m, key);
-
-    /* Linear probing, if necessary */
-    for(int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-        if (m->entries[curr].in_use == 1) {
-            if (strcmp(m->entries[curr].key, key) == 0)
-                return &m->entries[curr];
+    return map_get_entry_hashed(m, key, key_hash(key, strlen(key)));
+}
+
+
+/*
+ * Get the value of a key given its hash, keys whose TTL elapsed are not
+ * returned even if they are still waiting to be reclaimed
+ */
+void *map_get_hashed(map *m, const char *key, unsigned long hash) {
+    map_entry *e = map_get_entry_hashed(m, key, hash);
+    return e ? e->val : NULL;
+}
+
+
+/*
+ * Return the key-value pair represented by a key given its hash
+ */
+map_entry *map_get_entry_hashed(map *m, const char *key, unsigned long hash) {
+    map_entry *e = hashmap_find(m, key, hash);
+    if (!e || entry_expired(m, e))
+        return NULL;
+    entry_touch(e);
+    return e;
+}
+
+
+/*
+ * Return the entry of a key given its hash even if its TTL elapsed, for
+ * callers under a shared lock that must know if a write lock is worth taking
+ * to reclaim it. Only accesses to live entries are recorded
+ */
+map_entry *map_lookup_hashed(map *m, const char *key, unsigned long hash) {
+    map_entry *e = hashmap_find(m, key, hash);
+    if (e && !entry_expired(m, e))
+        entry_touch(e);
+    return e;
+}
+
+
+/*
+ * Check that no writer went through the map since a lock-free read started
+ * at start, loads made before are then known to form a consistent view
+ */
+static inline int read_valid(const unsigned long *seq, unsigned long start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) == start;
+}
+
+
+/*
+ * Lock-free version of hashmap_lookup, every candidate entry is copied into
+ * out and validated before its key is compared. Return the slot of the key,
+ * MAP_ERR if not found or MAP_RETRY if a writer interfered
+ */
+static long hashmap_read_lookup(const int8_t *ctrl, const map_entry *entries,
+        unsigned long table_size, const char *key, size_t klen,
+        unsigned long hash, const unsigned long *seq, unsigned long start,
+        map_entry *out) {
+    unsigned long mask = table_size - 1;
+    unsigned long pos = hash & mask;
+    int8_t tag = H2(hash);
+
+    for (unsigned long probed = 0; probed < table_size; probed += GROUP_WIDTH) {
+        unsigned int match = group_match(ctrl + pos, tag);
+        unsigned int empty = group_match(ctrl + pos, CTRL_EMPTY);
+        if (empty) match &= (empty & -empty) - 1;
+        while (match) {
+            unsigned long i = (pos + __builtin_ctz(match)) & mask;
+            *out = entries[i];
+            if (!read_valid(seq, start))
+                return MAP_RETRY;
+            if (entry_match(out, key, klen, hash))
+                return i;
+            match &= match - 1;
+        }
+        if (empty) break;
+        pos = (pos + GROUP_WIDTH) & mask;
+    }
+    return MAP_ERR;
+}
+
+
+/*
+ * Copy the value of a key into a new allocation without taking any lock,
+ * racing with the writers of the map. Writers keep *seq odd while they change
+ * the map, and start is the even value it had before the read began: loads
+ * are validated against it before following any pointer they returned, so a
+ * torn view is never dereferenced. The caller must be inside an epoch, the
+ * memory writers retire meanwhile stays valid until it leaves. Return MAP_OK
+ * with the copy in val, MAP_ERR if the key is missing, MAP_EXPIRED if its TTL
+ * elapsed or MAP_RETRY if a writer interfered
+ */
+int map_read_hashed(map *m, const char *key, unsigned long hash,
+        const unsigned long *seq, unsigned long start, char **val) {
+    size_t klen = strlen(key);
+    int8_t *ctrl = m->ctrl, *old_ctrl = m->old_ctrl;
+    map_entry *entries = m->entries, *old_entries = m->old_entries;
+    map_meta *meta = m->meta, *old_meta = m->old_meta;
+    unsigned long table_size = m->table_size, old_table_size = m->old_table_size;
+    if (!read_valid(seq, start))
+        return MAP_RETRY;
+
+    map_entry e;
+    long i = hashmap_read_lookup(ctrl, entries, table_size,
+            key, klen, hash, seq, start, &e);
+    if (i == MAP_ERR && old_entries) {
+        entries = old_entries;
+        meta = old_meta;
+        i = hashmap_read_lookup(old_ctrl, old_entries, old_table_size,
+                key, klen, hash, seq, start, &e);
+    }
+    if (i < 0)
+        /* A key moved by a rehash may have been missed in both tables */
+        return i == MAP_ERR && read_valid(seq, start) ? MAP_ERR : MAP_RETRY;
+    if (e.has_expire_time) {
+        long expire_time = meta[i].expire_time;
+        if (!read_valid(seq, start))
+            return MAP_RETRY;
+        if (expire_time <= current_timestamp())
+            return MAP_EXPIRED;
+    }
+
+    char *copy;
+    if (e.type != VAL_STR) {
+        char num[NUMBER_TEXT_LEN];
+        number_format(e.type, e.val, num);
+        copy = strdup(num);
+    } else {
+        /* Values updated in place may lack their terminator, bound the copy */
+        size_t room = e.embedded
+            ? slab_usable_size(e.key) - e.klen - 1
+            : slab_usable_size(e.val);
+        size_t vlen = strnlen(e.val, room);
+        copy = malloc(vlen + 1);
+        if (copy) {
+            memcpy(copy, e.val, vlen);
+            copy[vlen] = '\0';
         }
+    }
+    if (!copy) return MAP_ERR;
 
-        curr = (curr + 1) % m->table_size;
+    if (!read_valid(seq, start)) {
+        free(copy);
+        return MAP_RETRY;
     }
-    /* Not found */
-    return NULL;
+    entry_touch(&entries[i]);
+    *val = copy;
+    return MAP_OK;
+}
+
+
+/*
+ * Check if the TTL of an entry of the map elapsed
+ */
+int map_entry_expired(map *m, const map_entry *e) {
+    return entry_expired(m, e);
+}
+
+
+/*
+ * Return the metadata of an entry of the map, valid as long as the entry
+ * isn't moved by a write
+ */
+map_meta *map_entry_meta(map *m, const map_entry *e) {
+    return entry_meta(m, e);
+}
+
+
+/*
+ * Return a newly allocated copy of the value of an entry as text, numbers
+ * are rendered. The caller owns the string
+ */
+char *map_entry_value(const map_entry *e) {
+    if (e->type == VAL_STR)
+        return strdup(e->val);
+    char num[NUMBER_TEXT_LEN];
+    number_format(e->type, e->val, num);
+    return strdup(num);
+}
+
+
+/*
+ * Give a new version to an entry updated under a shared lock, other
+ * increments may be bumping the map counter at the same time
+ */
+static inline void entry_bump_version(map *m, map_entry *e) {
+    uint64_t version = __atomic_add_fetch(&m->version, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry_meta(m, e)->version, version, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Add by to the integer value of a key, updated in place with an atomic
+ * compare and swap so increments can run under a shared lock. Return MAP_ERR
+ * if the key is missing, holds a double or the sum overflows, and MAP_RETRY
+ * if its value is still text, to be encoded by map_encode_hashed first
+ */
+int map_incr_hashed(map *m, const char *key, unsigned long hash, int64_t by) {
+    map_entry *e = map_get_entry_hashed(m, key, hash);
+    if (!e || e->type == VAL_DOUBLE) return MAP_ERR;
+    if (e->type == VAL_STR) return MAP_RETRY;
+
+    int64_t *num = e->val;
+    int64_t cur = __atomic_load_n(num, __ATOMIC_RELAXED), sum;
+    do {
+        if (__builtin_add_overflow(cur, by, &sum))
+            return MAP_ERR;
+    } while (!__atomic_compare_exchange_n(num, &cur, sum, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    entry_bump_version(m, e);
+    return MAP_OK;
+}
+
+
+/*
+ * Add by to the double value of a key, like map_incr_hashed. Return MAP_ERR
+ * if the key is missing or the sum is not finite, and MAP_RETRY if its value
+ * is text or an integer, to be encoded by map_encode_hashed first
+ */
+int map_incrf_hashed(map *m, const char *key, unsigned long hash, double by) {
+    map_entry *e = map_get_entry_hashed(m, key, hash);
+    if (!e) return MAP_ERR;
+    if (e->type != VAL_DOUBLE) return MAP_RETRY;
+
+    uint64_t *num = e->val;
+    uint64_t cur = __atomic_load_n(num, __ATOMIC_RELAXED), bits;
+    do {
+        double d;
+        memcpy(&d, &cur, sizeof(double));
+        d += by;
+        if (!isfinite(d)) return MAP_ERR;
+        memcpy(&bits, &d, sizeof(double));
+    } while (!__atomic_compare_exchange_n(num, &cur, bits, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    entry_bump_version(m, e);
+    return MAP_OK;
+}
+
+
+/*
+ * Convert the value of a key to a number of the given type, text must parse
+ * as a number of that type and integers can become doubles, the rest of the
+ * entry is kept. Return MAP_ERR if the key is missing or can't be converted
+ */
+int map_encode_hashed(map *m, const char *key, unsigned long hash, int type) {
+    map_entry *e = map_get_entry_hashed(m, key, hash);
+    if (!e) return MAP_ERR;
+    if (e->type == type) return MAP_OK;
+
+    uint64_t bits;
+    if (type == VAL_INT) {
+        int64_t num;
+        if (e->type != VAL_STR || !parse_int64(e->val, &num))
+            return MAP_ERR;
+        memcpy(&bits, &num, sizeof(uint64_t));
+    } else if (type == VAL_DOUBLE) {
+        double num;
+        if (e->type == VAL_INT)
+            num = (double) *(int64_t *) e->val;
+        else if (!parse_double(e->val, &num))
+            return MAP_ERR;
+        memcpy(&bits, &num, sizeof(uint64_t));
+    } else {
+        return MAP_ERR;
+    }
+
+    map_entry old = *e;
+    if (entry_set_number(e, old.key, old.klen, type, bits) == MAP_ERR)
+        return MAP_ERR;
+    entry_retire(&old);
+    return MAP_OK;
+}
+
+
+/*
+ * Set key to val only if its version is still the given one, 0 standing for
+ * a key that doesn't exist or has expired. Return MAP_MISMATCH if the key
+ * was written in the meantime
+ */
+int map_cas_hashed(map *m, const char *key, unsigned long hash,
+        uint64_t version, const char *val) {
+    map_entry *e = hashmap_find(m, key, hash);
+    uint64_t current = e && !entry_expired(m, e) ? entry_meta(m, e)->version : 0;
+    if (current != version)
+        return MAP_MISMATCH;
+    return map_put_hashed(m, key, hash, val);
+}
+
+
+/*
+ * Set the absolute expire time of a key, in milliseconds since the epoch, or
+ * remove it when expire_time is negative. Return MAP_ERR if the key doesn't
+ * exist or already expired
+ */
+int map_set_expire_hashed(map *m, const char *key,
+        unsigned long hash, long expire_time) {
+    map_entry *e = map_get_entry_hashed(m, key, hash);
+    if (!e) return MAP_ERR;
+
+    map_meta *meta = entry_meta(m, e);
+    if (expire_time < 0) {
+        if (e->has_expire_time) m->expires--;
+        e->has_expire_time = 0;
+        meta->expire_time = -1;
+    } else {
+        if (!e->has_expire_time) m->expires++;
+        e->has_expire_time = 1;
+        meta->expire_time = expire_time;
+    }
+    return MAP_OK;
 }
 
 
@@ -205,28 +1199,158 @@ map_entry *map_get_entry(map *m, void *key) {
  * Remove an element with that key from the map
  */
 int map_del(map *m, void *key) {
+    return map_del_hashed(m, key, key_hash(key, strlen(key)));
+}
+
+
+/*
+ * Remove an element with that key from the map given the hash of the key
+ */
+int map_del_hashed(map *m, const char *key, unsigned long hash) {
+    if (m->old_entries) hashmap_rehash_step(m, REHASH_STEP);
     /* Find key */
-    int curr = hashmap_hash_int(m, key);
-    /* Linear probing, if necessary */
-    for(int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-        // check wether the position in array is in use
-        int in_use = m->entries[curr].in_use;
-        if (in_use == 1) {
-            if (strcmp(m->entries[curr].key, key) == 0) {
-                /* Blank out the fields */
-                m->entries[curr].in_use = 0;
-                m->entries[curr].has_expire_time = 0;
-                m->entries[curr].expire_time = -1;
-                m->entries[curr].creation_time = -1;
-                /* Reduce the size */
-                m->size--;
-                return MAP_OK;
+    size_t klen = strlen(key);
+    long i = hashmap_lookup(m->ctrl, m->entries, m->table_size, key, klen, hash);
+    int old = 0;
+    if (i < 0 && m->old_entries) {
+        i = hashmap_lookup(m->old_ctrl, m->old_entries,
+                m->old_table_size, key, klen, hash);
+        old = 1;
+    }
+    if (i < 0)
+        /* Data not found */
+        return MAP_ERR;
+    /* An expired key is reclaimed, but it was already gone for clients */
+    int expired = entry_expired(m, old ? &m->old_entries[i] : &m->entries[i]);
+    hashmap_delete(m, old, i);
+    hashmap_shrink(m);
+    return expired ? MAP_ERR : MAP_OK;
+}
+
+
+/*
+ * Remove a key only if its TTL elapsed, used to reclaim stale keys found by
+ * the read paths. Return MAP_OK if the key was removed
+ */
+int map_expire_hashed(map *m, const char *key, unsigned long hash) {
+    map_entry *e = hashmap_find(m, key, hash);
+    if (!e || !entry_expired(m, e))
+        return MAP_ERR;
+    map_del_hashed(m, key, hash);
+    return MAP_OK;
+}
+
+
+/*
+ * Active expiry, visit at most steps slots starting from cursor and reclaim
+ * the keys whose TTL elapsed. The cursor walks the current table and then
+ * the old one while a rehash is in progress, it's updated to resume the scan
+ * on the next call. Return the number of expired keys, sampled is increased
+ * by the number of keys with a TTL that were checked
+ */
+unsigned long map_expire_scan(map *m, unsigned long *cursor,
+        unsigned int steps, unsigned long *sampled) {
+    unsigned long expired = 0;
+    if (m->expires == 0) return 0;
+
+    long long now = current_timestamp();
+    for (; steps > 0; steps--) {
+        unsigned long total = m->table_size + m->old_table_size;
+        if (*cursor >= total) *cursor = 0;
+        int old = *cursor >= m->table_size;
+        unsigned long i = old ? *cursor - m->table_size : *cursor;
+        int8_t *ctrl = old ? m->old_ctrl : m->ctrl;
+        map_entry *e = old ? &m->old_entries[i] : &m->entries[i];
+
+        if (CTRL_FULL(ctrl[i]) && e->has_expire_time) {
+            (*sampled)++;
+            if (entry_meta(m, e)->expire_time <= now) {
+                /* The slot may be filled again by the backward shift */
+                hashmap_delete(m, old, i);
+                expired++;
+                if (m->expires == 0) break;
+                continue;
             }
         }
-        curr = (curr + 1) % m->table_size;
+        (*cursor)++;
     }
-    /* Data not found */
-    return MAP_ERR;
+    hashmap_shrink(m);
+    return expired;
+}
+
+
+/* Reverse the bits of a cursor */
+static unsigned long cursor_reverse(unsigned long v) {
+    unsigned long s = CHAR_BIT * sizeof(v), mask = ~0UL;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+
+/*
+ * Increment the reversed bits of a cursor within mask, so home buckets are
+ * visited from the highest bit down and a bucket of a table twice or half as
+ * large always maps to buckets already visited or still to visit
+ */
+static inline unsigned long cursor_next(unsigned long v, unsigned long mask) {
+    v |= ~mask;
+    v = cursor_reverse(v);
+    v++;
+    return cursor_reverse(v);
+}
+
+
+/*
+ * Call f on every live entry whose home is bucket b. With backward-shift
+ * deletion an entry is never separated from its home by an empty slot, so
+ * the cluster starting at b holds all of them
+ */
+static void hashmap_scan_bucket(map *m, const int8_t *ctrl, map_entry *entries,
+        unsigned long table_size, unsigned long b, func f, void *arg) {
+    unsigned long mask = table_size - 1;
+    for (unsigned long j = b; CTRL_FULL(ctrl[j]); j = (j + 1) & mask) {
+        map_entry *e = &entries[j];
+        if ((e->hash & mask) == b && !entry_expired(m, e))
+            f(arg, e);
+    }
+}
+
+
+/*
+ * Call f on the live entries of the home bucket pointed by cursor and return
+ * the cursor of the next one, 0 once the whole map has been visited. The
+ * cursor holds the bucket with its bits reversed, so entries present for the
+ * whole scan are reported at least once even if the table is resized between
+ * calls. While rehashing, the bucket of the smaller table is visited along
+ * with all the buckets of the larger one it expands to
+ */
+unsigned long map_scan(map *m, unsigned long cursor, func f, void *arg) {
+    if (!m->old_entries) {
+        unsigned long mask = m->table_size - 1;
+        hashmap_scan_bucket(m, m->ctrl, m->entries, m->table_size,
+                cursor & mask, f, arg);
+        return cursor_next(cursor, mask);
+    }
+
+    int old_small = m->old_table_size < m->table_size;
+    int8_t *ctrl0 = old_small ? m->old_ctrl : m->ctrl;
+    int8_t *ctrl1 = old_small ? m->ctrl : m->old_ctrl;
+    map_entry *entries0 = old_small ? m->old_entries : m->entries;
+    map_entry *entries1 = old_small ? m->entries : m->old_entries;
+    unsigned long size0 = old_small ? m->old_table_size : m->table_size;
+    unsigned long size1 = old_small ? m->table_size : m->old_table_size;
+    unsigned long mask0 = size0 - 1, mask1 = size1 - 1;
+
+    hashmap_scan_bucket(m, ctrl0, entries0, size0, cursor & mask0, f, arg);
+    do {
+        hashmap_scan_bucket(m, ctrl1, entries1, size1, cursor & mask1, f, arg);
+        cursor = cursor_next(cursor, mask1);
+    } while (cursor & (mask0 ^ mask1));
+
+    return cursor;
 }
 
 
@@ -239,13 +1363,20 @@ int map_iterate2(map *m, func f, void *arg1) {
     /* On empty hashmap, return immediately */
     if (m->size <= 0) return MAP_ERR;
     /* Linear probing */
-    for(int i = 0; i < m->table_size; i++) {
-        if (m->entries[i].in_use != 0) {
+    for(unsigned long i = 0; i < m->table_size; i++) {
+        if (CTRL_FULL(m->ctrl[i])) {
             map_entry data = m->entries[i];
             int status = f(arg1, &data);
             if (status != MAP_OK) return status;
         }
     }
+    for(unsigned long i = 0; i < m->old_table_size; i++) {
+        if (CTRL_FULL(m->old_ctrl[i])) {
+            map_entry data = m->old_entries[i];
+            int status = f(arg1, &data);
+            if (status != MAP_OK) return status;
+        }
+    }
     return MAP_OK;
 }
 
@@ -259,40 +1390,146 @@ int map_iterate3(map *m, func3 f, void *arg1, void *arg2) {
     /* On empty hashmap, return immediately */
     if (m->size <= 0) return MAP_ERR;
     /* Linear probing */
-    for(int i = 0; i < m->table_size; i++) {
-        if (m->entries[i].in_use != 0) {
+    for(unsigned long i = 0; i < m->table_size; i++) {
+        if (CTRL_FULL(m->ctrl[i])) {
             map_entry data = m->entries[i];
             int status = f(arg1, arg2, &data);
             if (status != MAP_OK) return status;
         }
     }
+    for(unsigned long i = 0; i < m->old_table_size; i++) {
+        if (CTRL_FULL(m->old_ctrl[i])) {
+            map_entry data = m->old_entries[i];
+            int status = f(arg1, arg2, &data);
+            if (status != MAP_OK) return status;
+        }
+    }
     return MAP_OK;
 }
 
 
+/*
+ * Advance a rehash in progress by steps slots, so that tables resized by the
+ * last writes before a quiet period don't stay around until the next write.
+ * Return 1 if the map is still rehashing
+ */
+int map_rehash_step(map *m, unsigned long steps) {
+    if (m->old_entries)
+        hashmap_rehash_step(m, steps);
+    else
+        hashmap_shrink(m);
+    return m->old_entries != NULL;
+}
+
+
+static int index_insert(void *arg, void *data) {
+    map_entry *e = (map_entry *) data;
+    return skiplist_insert((skiplist *) arg, e->key, e->klen, e->hash);
+}
+
+
+/*
+ * Keep the keys of the map in order in a skiplist from now on, starting with
+ * the ones it already holds. Return MAP_ERR if the index couldn't be built
+ */
+int map_index(map *m) {
+    if (m->index) return MAP_OK;
+    skiplist *index = skiplist_create();
+    if (!index) return MAP_ERR;
+    if (m->size > 0 && map_iterate2(m, index_insert, index) != MAP_OK) {
+        skiplist_release(index);
+        return MAP_ERR;
+    }
+    m->index = index;
+    return MAP_OK;
+}
+
+
+/*
+ * Stop keeping the keys of the map in order, releasing the index
+ */
+void map_unindex(map *m) {
+    skiplist_release(m->index);
+    m->index = NULL;
+}
+
+
+/*
+ * Tell if a key is in the map and alive without recording an access, used to
+ * filter the keys found in the index
+ */
+int map_live_hashed(map *m, const char *key, unsigned long hash) {
+    map_entry *e = hashmap_find(m, key, hash);
+    return e && !entry_expired(m, e);
+}
+
+
+/*
+ * Shrink the table to the smallest size fitting the keys left and complete
+ * any rehash right away, giving back to the OS the memory of the old table
+ */
+void map_compact(map *m) {
+    if (m->old_entries)
+        hashmap_rehash_step(m, m->old_table_size * 2);
+    if (hashmap_fit_size(m) < m->table_size
+            && hashmap_rehash(m, hashmap_fit_size(m)) == MAP_OK)
+        hashmap_rehash_step(m, m->old_table_size * 2);
+}
+
+
+/*
+ * Fill out with up to n entries taken from consecutive slots starting from
+ * a random position, only the ones with a TTL if volatile_only is set. Used
+ * to approximate eviction policies without keeping any ordering of the keys,
+ * return the number of entries found
+ */
+unsigned int map_sample(map *m, unsigned long start,
+        int volatile_only, map_entry **out, unsigned int n) {
+    unsigned int found = 0;
+    if (m->size == 0 || (volatile_only && m->expires == 0))
+        return 0;
+
+    unsigned long total = m->table_size + m->old_table_size;
+    for (unsigned int i = 0; i < SAMPLE_SCAN && found < n; i++) {
+        unsigned long pos = (start + i) % total;
+        int8_t *ctrl = m->ctrl;
+        map_entry *e = &m->entries[pos];
+        if (pos >= m->table_size) {
+            pos -= m->table_size;
+            ctrl = m->old_ctrl;
+            e = &m->old_entries[pos];
+        }
+        if (CTRL_FULL(ctrl[pos]) && (!volatile_only || e->has_expire_time))
+            out[found++] = e;
+    }
+    return found;
+}
+
+
 /* callback function used with iterate to clean up the hashmap */
 static int destroy(void *t1, void *t2) {
 
     map_entry *kv = (map_entry *) t2;
 
     if (kv) {
-        // free key field
-        if (kv->key)
-            free(kv->key);
-        // free value field
-        if (kv->val)
-            free(kv->val);
+        // free key field, and value field too if not embedded
+        entry_free(kv);
     } else return MAP_ERR;
 
     return MAP_OK;
 }
 
-/* Deallocate the hashmap */
+/*
+ * Deallocate the hashmap, a map reachable by lock-free readers must be
+ * retired with epoch_retire instead
+ */
 void map_release(map *m){
-    map_iterate2(m, destroy, NULL);
     if (m) {
-        if (m->entries)
-            free(m->entries);
+        map_iterate2(m, destroy, NULL);
+        hashmap_free_table(m->table_size, m->ctrl, m->entries, m->meta);
+        hashmap_free_table(m->old_table_size, m->old_ctrl,
+                m->old_entries, m->old_meta);
+        skiplist_release(m->index);
         free(m);
     }
 }
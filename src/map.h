@@ -23,44 +23,151 @@
 #define MAP_H
 
 
+#include <stdint.h>
+#include "skiplist.h"
+
+
 #define MAP_OK              0
 #define MAP_ERR             -1
 #define MAP_FULL            -2
+/* A lock-free read raced with a writer */
+#define MAP_RETRY           -3
+#define MAP_EXPIRED         -4
+/* A conditional write found a different version of the key */
+#define MAP_MISMATCH        -5
+
+/* Control bytes, a full slot stores instead the top 7 bits of its hash */
+#define CTRL_EMPTY          ((int8_t) -128)
+#define CTRL_FULL(c)        ((c) >= 0)
+
+/* Number of control bytes compared at once while probing */
+#define GROUP_WIDTH         16
+
+/* Values shorter than this share a single allocation with their key */
+#define EMBED_VAL_MAX       32
+
+/* Encodings of a value, numbers are kept in binary right after their key */
+#define VAL_STR             0
+#define VAL_INT             1
+#define VAL_DOUBLE          2
+
+/* Room needed to render a number value as text */
+#define NUMBER_TEXT_LEN     64
+
+/* Access clock of the entries, in seconds, it wraps around every 194 days */
+#define ACCESS_CLOCK_MASK   0xFFFFFF
+/* Initial access frequency of a new key, so it's not evicted right away */
+#define LFU_INIT            5
 
 
 typedef int (*func)(void *, void *);
 typedef int (*func3)(void *, void *, void *);
 
 
-/* We need to keep keys and values */
+/*
+ * We need to keep keys and values, the full hash and the length of the key are
+ * cached so probing and rehashing never need to read the key itself. Short
+ * values are embedded right after their key in a single block, longer ones
+ * spill to an allocation of their own. Integers and doubles are embedded in
+ * binary form instead, val points to an aligned int64_t or double updated in
+ * place and rendered as text only when read. The access word holds the clock
+ * of the last access in its top 24 bits and a logarithmic access counter in
+ * the low 8 ones, both are used to pick the keys to evict. Fields seldom read
+ * while probing live in a map_meta of their own, so an entry takes 32 bytes
+ * and a cache line holds two of them, has_expire_time tells if the TTL in the
+ * metadata has to be looked at at all
+ */
 typedef struct {
     void *key;
     void *val;
-    unsigned int in_use : 1;
+    unsigned long hash;
+    unsigned int klen : 28;
+    unsigned int type : 2;
+    unsigned int embedded : 1;
     unsigned int has_expire_time : 1;
+    uint32_t access;
+} map_entry;
+
+
+/*
+ * Cold metadata of an entry, kept in an array parallel to the entries so the
+ * metadata of entries[i] is meta[i]. Every write of the value gives the entry
+ * a new version, taken from a counter of its map so that a key deleted and
+ * set again never gets back an old one
+ */
+typedef struct {
     long creation_time;
     long expire_time;
-} map_entry;
+    uint64_t version;
+} map_meta;
 
 
 /*
  * An hashmap has some maximum size and current size, as well as the data to
- * hold.
+ * hold. Every slot has a 1-byte control tag stored apart in ctrl, telling if
+ * it's empty or full, so probing rarely touches the entries at all, and the
+ * metadata of every slot is stored apart in meta.
+ * While growing or shrinking, the previous table is kept alongside the new one
+ * and drained incrementally starting from rehash_idx. The number of keys with
+ * a TTL is tracked in expires, so maps without any are skipped by the active
+ * expiry. When index is set, every key is also kept in order in a skiplist
+ * serving range and prefix queries. version is the last version given to a
+ * write. Large tables are allocated on NUMA node node, if not negative.
  */
 typedef struct {
+    map_entry *entries;
+    map_meta *meta;
     unsigned long table_size;
     unsigned long size;
-    map_entry *entries;
+    int8_t *ctrl;
+    map_entry *old_entries;
+    map_meta *old_meta;
+    int8_t *old_ctrl;
+    unsigned long old_table_size;
+    unsigned long rehash_idx;
+    unsigned long expires;
+    skiplist *index;
+    uint64_t version;
+    int node;
 } map;
 
 
 /* Map API */
 map *map_create(void);
 void map_release(map *);
-int map_put(map *, void *, void *);
+int map_put(map *, const char *, const char *);
+int map_put_hashed(map *, const char *, unsigned long, const char *);
 void *map_get(map *, void *);
 map_entry *map_get_entry(map *, void *);
+void *map_get_hashed(map *, const char *, unsigned long);
+map_entry *map_get_entry_hashed(map *, const char *, unsigned long);
+map_entry *map_lookup_hashed(map *, const char *, unsigned long);
+int map_read_hashed(map *, const char *, unsigned long,
+        const unsigned long *, unsigned long, char **);
+int map_entry_expired(map *, const map_entry *);
+map_meta *map_entry_meta(map *, const map_entry *);
+char *map_entry_value(const map_entry *);
+int map_incr_hashed(map *, const char *, unsigned long, int64_t);
+int map_incrf_hashed(map *, const char *, unsigned long, double);
+int map_encode_hashed(map *, const char *, unsigned long, int);
+int map_cas_hashed(map *, const char *, unsigned long, uint64_t, const char *);
+int map_set_expire_hashed(map *, const char *, unsigned long, long);
 int map_del(map *, void *);
+int map_del_hashed(map *, const char *, unsigned long);
+int map_expire_hashed(map *, const char *, unsigned long);
+unsigned long map_expire_scan(map *, unsigned long *, unsigned int, unsigned long *);
+unsigned long map_scan(map *, unsigned long, func, void *);
+int map_rehash_step(map *, unsigned long);
+int map_index(map *);
+void map_unindex(map *);
+int map_live_hashed(map *, const char *, unsigned long);
+void map_compact(map *);
+unsigned int map_sample(map *, unsigned long, int, map_entry **, unsigned int);
+unsigned long map_entry_idle(const map_entry *);
+unsigned int map_entry_freq(const map_entry *);
+void map_clock_tick(void);
+void map_huge_pages(int);
+size_t map_tables_memory(void);
 int map_iterate2(map *, func, void *);
 int map_iterate3(map *, func3, void *, void *);
 
@@ -21,15 +21,26 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include "networking.h"
+#include "store.h"
+#include "hashing.h"
 #include "util.h"
 
 
+#define STORE_KEYS      100000
+#define STORE_OPS       1000000
+#define STORE_MAX_TH    16
+#define GROWTH_KEYS     2000000
+#define PIPE_OPS        400000
+#define PIPE_MAX_CONNS  64
+
+
 
 struct connection {
     char *host;
@@ -116,8 +127,240 @@ static void *make_requests(void *t) {
 }
 
 
+struct store_job {
+    store *s;
+    unsigned int seed;
+    int get_ratio;      // percentage of GET over the total of operations
+};
+
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec)
+        + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static void *store_requests(void *t) {
+    struct store_job *job = (struct store_job *) t;
+    char key[16];
+
+    for (int i = 0; i < STORE_OPS; ++i) {
+        snprintf(key, 16, "%d", rand_r(&job->seed) % STORE_KEYS);
+        if (rand_r(&job->seed) % 100 < job->get_ratio) {
+            free(store_get(job->s, key, key_hash(key, strlen(key))));
+        } else {
+            store_put(job->s, key, key_hash(key, strlen(key)), "value");
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Run the same mixed workload directly against the sharded store with a
+ * growing number of threads, bypassing the network, to measure how the
+ * keyspace scales across cores
+ */
+static int store_benchmark(int get_ratio) {
+
+    store *s = store_create();
+    char key[16];
+    pthread_t th[STORE_MAX_TH];
+    struct store_job jobs[STORE_MAX_TH];
+    struct timespec start_time, end_time;
+
+    for (int j = 0; j < STORE_KEYS; ++j) {
+        snprintf(key, 16, "%d", j);
+        store_put(s, key, key_hash(key, strlen(key)), "value");
+    }
+
+    printf("\n");
+    printf(" Store scaling, %d keys, %d%% GET, %d operations per thread\n\n",
+            STORE_KEYS, get_ratio, STORE_OPS);
+
+    for (int n = 1; n <= STORE_MAX_TH; n *= 2) {
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (int i = 0; i < n; ++i) {
+            jobs[i] = (struct store_job) { s, i + 1, get_ratio };
+            if (pthread_create(&th[i], NULL, store_requests, &jobs[i]) != 0)
+                perror("pthread");
+        }
+        for (int i = 0; i < n; ++i)
+            pthread_join(th[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+        double time_elapsed = elapsed(&start_time, &end_time);
+        printf(" [%2d threads] - Elapsed time: %f s  Op/s: %.2f\n",
+                n, time_elapsed, ((double) n * STORE_OPS) / time_elapsed);
+    }
+
+    printf("\n");
+    store_release(s);
+    return 0;
+}
+
+
+struct pipe_job {
+    char *host;
+    char *port;
+    int id;
+    int depth;
+    int ops;
+};
+
+
+/*
+ * Send SET and GET in turn in batches of depth requests, waiting for all the
+ * replies of a batch before sending the next one
+ */
+static void *pipe_requests(void *t) {
+    struct pipe_job *job = (struct pipe_job *) t;
+    int fd = connectto(job->host, job->port);
+    if (fd < 0)
+        return NULL;
+    char *out = malloc(job->depth * 64);
+    char in[65536];
+
+    for (int done = 0; done < job->ops; done += job->depth) {
+        int len = 0, n = 0;
+        for (; n < job->depth && done + n < job->ops; ++n)
+            len += sprintf(out + len, (n & 1) ? "get k%d_%d\r\n"
+                    : "set k%d_%d value\r\n", job->id, (done + n) / 2);
+        if (send_all(fd, out, &len) < 0) {
+            perror("send");
+            break;
+        }
+        for (int replies = 0; replies < n;) {
+            ssize_t r = read(fd, in, sizeof(in));
+            if (r <= 0) {
+                perror("read");
+                goto out;
+            }
+            for (ssize_t i = 0; i < r; ++i)
+                replies += in[i] == '\n';
+        }
+    }
+
+out:
+    free(out);
+    close(fd);
+    return NULL;
+}
+
+
+/*
+ * Measure the throughput of a server with many connections sending pipelined
+ * requests, for a growing pipeline depth, to compare the event loop backends
+ */
+static int pipe_benchmark(char *host, char *port, int conns) {
+
+    pthread_t th[PIPE_MAX_CONNS];
+    struct pipe_job jobs[PIPE_MAX_CONNS];
+    struct timespec start_time, end_time;
+    int depths[] = { 1, 16, 128 };
+
+    if (conns < 1 || conns > PIPE_MAX_CONNS)
+        conns = 4;
+
+    printf("\n");
+    printf(" Pipelined SET/GET, %d requests over %d connections\n\n",
+            PIPE_OPS, conns);
+
+    for (unsigned int d = 0; d < sizeof(depths) / sizeof(int); ++d) {
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (int i = 0; i < conns; ++i) {
+            jobs[i] = (struct pipe_job) { host, port, i, depths[d], PIPE_OPS / conns };
+            if (pthread_create(&th[i], NULL, pipe_requests, &jobs[i]) != 0)
+                perror("pthread");
+        }
+        for (int i = 0; i < conns; ++i)
+            pthread_join(th[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+        double time_elapsed = elapsed(&start_time, &end_time);
+        printf(" [depth %3d] - Elapsed time: %f s  Op/s: %.2f\n", depths[d],
+                time_elapsed, ((double) conns * (PIPE_OPS / conns)) / time_elapsed);
+    }
+
+    printf("\n");
+    return 0;
+}
+
+
+static int cmp_latency(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Insert a growing number of distinct keys into a single map, crossing many
+ * resize thresholds, and report the latency distribution of every SET. Keys
+ * are left-padded to keylen bytes
+ */
+static int growth_benchmark(int keys, int keylen) {
+
+    map *m = map_create();
+    long *latencies = malloc(sizeof(long) * keys);
+    char key[keylen + 16];
+    struct timespec start_time, end_time, op_start, op_end;
+
+    printf("\n");
+    printf(" Growth-heavy SET, %d distinct keys of %d bytes into a single map\n\n",
+            keys, keylen);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < keys; ++i) {
+        snprintf(key, keylen + 16, "%0*d", keylen, i);
+        clock_gettime(CLOCK_MONOTONIC, &op_start);
+        map_put(m, key, "value");
+        clock_gettime(CLOCK_MONOTONIC, &op_end);
+        latencies[i] = (op_end.tv_sec - op_start.tv_sec) * 1000000000L
+            + (op_end.tv_nsec - op_start.tv_nsec);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    double time_elapsed = elapsed(&start_time, &end_time);
+    qsort(latencies, keys, sizeof(long), cmp_latency);
+
+    printf(" [SET] - Elapsed time: %f s  Op/s: %.2f\n",
+            time_elapsed, keys / time_elapsed);
+    printf(" [SET] - p50: %ld ns  p99: %ld ns  p99.9: %ld ns  max: %ld ns\n",
+            latencies[keys / 2], latencies[(long) keys * 99 / 100],
+            latencies[(long) keys * 999 / 1000], latencies[keys - 1]);
+
+    /* Lookup of missing keys, they share the length of the stored ones */
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < keys; ++i) {
+        snprintf(key, keylen + 16, "%0*d", keylen, keys + i);
+        map_get(m, key);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    time_elapsed = elapsed(&start_time, &end_time);
+    printf(" [GET miss] - Elapsed time: %f s  Op/s: %.2f\n",
+            time_elapsed, keys / time_elapsed);
+    printf("\n");
+
+    free(latencies);
+    map_release(m);
+    return 0;
+}
+
+
 int main(int argc, char **argv) {
 
+    if (argc > 1 && strcmp(argv[1], "store") == 0)
+        return store_benchmark(argc > 2 ? GETINT(argv[2]) : 90);
+
+    if (argc > 1 && strcmp(argv[1], "growth") == 0)
+        return growth_benchmark(argc > 2 ? GETINT(argv[2]) : GROWTH_KEYS,
+                argc > 3 ? GETINT(argv[3]) : 8);
+
+    if (argc > 3 && strcmp(argv[1], "pipeline") == 0)
+        return pipe_benchmark(argv[2], argv[3], argc > 4 ? GETINT(argv[4]) : 4);
+
     char *host = "127.0.0.1";
     char *port = "8082";
     int thread_nr = 50;
@@ -133,6 +133,8 @@ void banner(void) {
 void help(void) {
     printf("\n");
     printf("SET key value               Sets <key> to <value>\n");
+    printf("CAS key version value       Sets <key> to <value> only if its version is still\n");
+    printf("                            <version>, 0 if the key must not exist\n");
     printf("GET key                     Get the value identified by <key>\n");
     printf("DEL key key2 .. keyN        Delete values identified by <key>..<keyN>\n");
     printf("INC key qty                 Increment by <qty> the value idenfied by <key>, if\n");
@@ -144,10 +146,25 @@ void help(void) {
     printf("DECF                        key qty Decrement by <qty> the value identified by <key>,\n");
     printf("                            if no <qty> is specified decrement by 1.0\n");
     printf("GETP key                    Get all information of a key-value pair represented by\n");
-    printf("                            <key>, like key, value, creation time and expire time\n");
+    printf("                            <key>, like key, value, version, creation time and\n");
+    printf("                            expire time\n");
     printf("APPEND key value            Append <value> to <key>\n");
     printf("PREPEND key value           Prepend <value> to <key>\n");
     printf("FLUSH                       Delete all maps stored inside partitions\n");
+    printf("INFO                        Show memory usage and slab allocator utilization\n");
+    printf("SETEX key seconds value     Sets <key> to <value>, the key expires after <seconds>\n");
+    printf("EXPIRE key seconds          Set <key> to expire after <seconds>\n");
+    printf("TTL key                     Get the seconds left before <key> expires, -1 if it\n");
+    printf("                            has no TTL and -2 if it does not exist\n");
+    printf("PERSIST key                 Remove the TTL of <key>\n");
+    printf("COMPACT                     Shrink tables to fit the keys and release unused\n");
+    printf("                            memory, returning the number of bytes released\n");
+    printf("RANGE from to count         List in order the keys between <from> and <to>, at\n");
+    printf("                            most <count> if specified\n");
+    printf("PREFIX prefix count         List in order the keys starting with <prefix>, at\n");
+    printf("                            most <count> if specified\n");
+    printf("SCAN cursor MATCH p COUNT n Walk the keys from cursor 0, return the next cursor\n");
+    printf("                            and the keys found matching the optional glob <p>\n");
     printf("QUIT/EXIT                   Close connection\n");
     printf("\n");
 }
@@ -31,6 +31,27 @@
 #include "util.h"
 #include "cluster.h"
 #include "networking.h"
+#include "numa.h"
+
+
+/*
+ * Parse a number of bytes with an optional k, m or g suffix, return 0 if it
+ * isn't valid
+ */
+static size_t parse_memory(const char *arg) {
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg) return 0;
+    switch (*end) {
+        case 'g': case 'G': n <<= 10; /* fall through */
+        case 'm': case 'M': n <<= 10; /* fall through */
+        case 'k': case 'K': n <<= 10; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    if (*end == 'b' || *end == 'B') end++;
+    return *end == '\0' ? n : 0;
+}
 
 
 static void exit_handler(int sig) {
@@ -92,10 +113,17 @@ int main(int argc, char **argv) {
     char *filename = malloc(strlen(home) + strlen(confpath));
     sprintf(filename, "%s%s", home, confpath);
     char *id = NULL;
-    int opt, cluster_mode = 0;
+    int opt, cluster_mode = 0, workers = EPOLL_WORKERS;
+    size_t maxmemory = 0;
+    int policy = NOEVICTION;
+    int indexed = 0;
+    int huge_pages = 0;
+    int numa = 0;
+    int reuseport = 0;
+    int backend = BACKEND_EPOLL;
     static pthread_t thread;
 
-    while((opt = getopt(argc, argv, "a:i:p:cf:")) != -1) {
+    while((opt = getopt(argc, argv, "a:i:p:cf:w:m:e:oHNrb:")) != -1) {
         switch(opt) {
             case 'a':
                 address = optarg;
@@ -113,6 +141,41 @@ int main(int argc, char **argv) {
                 filename = optarg;
                 cluster_mode = 1;
                 break;
+            case 'w':
+                workers = GETINT(optarg);
+                break;
+            case 'm':
+                if ((maxmemory = parse_memory(optarg)) == 0) {
+                    fprintf(stderr, "Invalid memory limit %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if ((policy = store_policy(optarg)) < 0) {
+                    fprintf(stderr, "Unknown eviction policy %s, must be one of "
+                            "noeviction, allkeys-lru, allkeys-lfu, volatile-ttl\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                indexed = 1;
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
+            case 'N':
+                numa = 1;
+                break;
+            case 'r':
+                reuseport = 1;
+                break;
+            case 'b':
+                if ((backend = event_backend(optarg)) < 0) {
+                    fprintf(stderr, "Unknown backend %s, must be one of "
+                            "epoll, io_uring\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
                 cluster_mode = 0;
                 break;
@@ -124,6 +187,16 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (workers < 1) {
+        fprintf(stderr, "Number of workers must be at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+
+    map_huge_pages(huge_pages);
+    /* Topology must be known before the shards are allocated */
+    if (numa && numa_init() == 0)
+        fprintf(stderr, "Single NUMA node, NUMA mode has no effect\n");
+
     char bus_port[20];
     int bport = GETINT(port) + 100;
     sprintf(bus_port, "%d", bport);
@@ -215,6 +288,14 @@ int main(int argc, char **argv) {
 		init_system(0, id, address, port, bus_port);
     }
 
+    instance.el.epoll_workers = workers;
+    instance.el.reuseport = reuseport;
+    instance.el.backend = backend;
+    instance.store->maxmemory = maxmemory;
+    instance.store->policy = policy;
+    if (indexed && store_index(instance.store, 1) == MAP_ERR)
+        fprintf(stderr, "Couldn't build the ordered index of the keys\n");
+
     /* start the main listen loop */
 	start_loop();
     return 0;
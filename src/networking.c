@@ -30,13 +30,42 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include "networking.h"
 #include "commands.h"
 #include "cluster.h"
 #include "event.h"
+#include "numa.h"
+#include "session.h"
+#include "uring.h"
+
+
+/*
+ * In NUMA mode the workers of every node wait on an epoll instance of their
+ * own, node_epollfd, while in reuseport mode every worker has its own. The
+ * epoll instance serving every client descriptor is then kept in fd_epollfd
+ * so that replies are scheduled on the right one
+ */
+static int *node_epollfd;
+static int *fd_epollfd;
+static unsigned long fd_epollfd_len;
+
+
+/*
+ * Epoll instance and CPU of a worker, a negative CPU leaves it unpinned. In
+ * reuseport mode listenfd is the listening socket of the worker, which
+ * accepts its own clients, otherwise it's negative
+ */
+typedef struct {
+    int epollfd;
+    int cpu;
+    int listenfd;
+} worker_conf;
 
 
 void init_event_loop(const char *host,
@@ -60,6 +89,12 @@ void init_event_loop(const char *host,
 		exit(EXIT_FAILURE);
 	}
 
+	/* initialize the sessions holding the state of every connection */
+	if (session_init() == -1) {
+		perror("session table not created");
+		exit(EXIT_FAILURE);
+	}
+
 	instance.el.server_handler = client_command_handler;
 	instance.el.cluster_handler = peer_command_handler;
 }
@@ -123,9 +158,13 @@ static int create_and_bind(const char *host, const char *port) {
         if (sfd == -1) continue;
 
         /* set SO_REUSEADDR so the socket will be reusable after process kill */
-        if (setsockopt(sfd, SOL_SOCKET, (SO_REUSEPORT | SO_REUSEADDR),
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
                     &(int) { 1 }, sizeof(int)) < 0)
             perror("SO_REUSEADDR");
+        /* let every worker bind a socket of its own on the same port */
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT,
+                    &(int) { 1 }, sizeof(int)) < 0)
+            perror("SO_REUSEPORT");
 
         if ((bind(sfd, rp->ai_addr, rp->ai_addrlen)) == 0) {
             /* Succesful bind */
@@ -203,9 +242,405 @@ int connectto(const char *host, const char *port) {
 }
 
 
+/*
+ * Hand every complete request in the input buffer of a connection to
+ * handler, a partial request left at the end waits for more data. Peer nodes
+ * send serialized messages while clients send lines. Return 1 if the
+ * connection must be closed
+ */
+static int handle_requests(session *s, fd_handler handler, int peer) {
+    char *req;
+    while ((req = peer ? session_frame(s) : session_line(s)) != NULL) {
+        int done = handler(s->fd, req);
+        if (done == END || done == 1)
+            return 1;
+    }
+    if (s->broken)
+        return 1;
+    session_compact(s);
+    return 0;
+}
+
+
+/*
+ * Read every request available on a connection and handle them. A read that
+ * doesn't fill the buffer drained the socket, anything arriving later wakes
+ * up the connection again once it's re-armed. Return 1 if the connection
+ * must be closed
+ */
+static int read_requests(session *s, fd_handler handler, int peer) {
+    for (;;) {
+        int n = session_fill(s, s->fd);
+        if (n == 0)
+            return 1;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+        int drained = s->len < s->cap;
+        if (handle_requests(s, handler, peer) == 1)
+            return 1;
+        if (drained)
+            return 0;
+    }
+}
+
+
+/*
+ * Serve a connection woken up on epollfd, reading the requests that arrived
+ * and writing the replies waiting right away, and arm it again for the next
+ * event. It's armed for writing only if the socket couldn't take all the
+ * replies. Return 1 if the connection must be closed
+ */
+static int serve_connection(session *s, int epollfd,
+        uint32_t events, fd_handler handler, int peer) {
+    /* Re-armed by a reply while served elsewhere, the owner takes care */
+    if (session_acquire(s) == -1)
+        return 0;
+    int closing = (events & EPOLLIN) && read_requests(s, handler, peer) == 1;
+    /* Answer the requests before a QUIT too */
+    if (session_flush(s) < 0 || closing)
+        return 1;
+    session_release(s, epollfd);
+    return 0;
+}
+
+
+/*
+ * Drop the state of a connection and close it
+ */
+static void close_connection(int fd) {
+    DEBUG("Closing connection\n");
+    session_close(fd);
+    close(fd);
+}
+
+
+/*
+ * Accept all the clients waiting on the listening socket of a worker in
+ * reuseport mode. They're served by the worker for their whole life, so
+ * they're registered once for good
+ */
+static void accept_clients(int listenfd, int epollfd) {
+    struct sockaddr addr;
+    socklen_t addrlen = sizeof addr;
+    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+
+    for (;;) {
+        int fd = accept(listenfd, &addr, &addrlen);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        set_nonblocking(fd);
+        /* Start from a clean state, the descriptor may have been used before */
+        session_close(fd);
+        session *s = session_get(fd);
+        if (!s) {
+            close(fd);
+            continue;
+        }
+        s->persistent = 1;
+        if (fd_epollfd && (unsigned long) fd < fd_epollfd_len)
+            fd_epollfd[fd] = epollfd;
+        /* Pipelined replies are sent as they come, don't wait for acks */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+        ADD_FD_ET(epollfd, fd);
+
+        getnameinfo(&addr, addrlen, hbuf, sizeof(hbuf),
+                sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
+        DEBUG("Connection %s:%s\n", hbuf, sbuf);
+        addrlen = sizeof addr;
+    }
+}
+
+
+/* Operations in flight on a ring, kept in the low bits of their tag */
+#define RING_ACCEPT     0
+#define RING_RECV       1
+#define RING_SEND       2
+#define RING_WAKE       3
+#define RING_OP_MASK    3
+
+#define RING_TAG(c, op) ((uint64_t) (uintptr_t) (c) | (op))
+
+
+/*
+ * A client connection served by an io_uring worker. A multishot receive
+ * stays armed on it and at most a send is in flight, its message is kept
+ * here until completed. Pending connections may have replies to send, they
+ * are all sent at once before waiting on the ring again. Once closing, the
+ * socket is shut down and the connection released when nothing is left in
+ * flight on it
+ */
+typedef struct ring_conn {
+    session *s;
+    int fd;
+    unsigned int receiving : 1;
+    unsigned int sending : 1;
+    unsigned int quitting : 1;
+    unsigned int closing : 1;
+    unsigned int pending : 1;
+    struct msghdr msg;
+    struct iovec iov[SESSION_IOV_MAX];
+    struct ring_conn *prev;
+    struct ring_conn *next;
+    struct ring_conn *next_pending;
+} ring_conn;
+
+
+/*
+ * An io_uring worker, its connections and those pending. Other threads
+ * pushing replies to its connections wake it up through wakefd. accepting
+ * is cleared while no accept is armed on listenfd
+ */
+typedef struct {
+    uring ring;
+    int listenfd;
+    int wakefd;
+    int accepting;
+    uint64_t wakeval;
+    ring_conn *conns;
+    ring_conn *pending;
+} ring_worker;
+
+
+/* Eventfd of the io_uring worker running on the calling thread, if any */
+static __thread int ring_wakefd = -1;
+
+
+static void ring_pend(ring_worker *w, ring_conn *c) {
+    if (c->pending)
+        return;
+    c->pending = 1;
+    c->next_pending = w->pending;
+    w->pending = c;
+}
+
+
+/*
+ * Shut a connection down, it's released once nothing is left in flight on it
+ */
+static void ring_close(ring_worker *w, ring_conn *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        /* Ends the receive armed on it */
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    if (c->receiving || c->sending || c->pending)
+        return;
+    if (c->prev) c->prev->next = c->next;
+    else w->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    close_connection(c->fd);
+    free(c);
+}
+
+
+/*
+ * Start serving a client accepted on the ring, it stays on the worker for its
+ * whole life
+ */
+static void ring_accept(ring_worker *w, int fd) {
+    /* Start from a clean state, the descriptor may have been used before */
+    session_close(fd);
+    session *s = session_get(fd);
+    ring_conn *c = s ? calloc(1, sizeof(ring_conn)) : NULL;
+    if (!c) {
+        close(fd);
+        return;
+    }
+    /* Pipelined replies are sent as they come, don't wait for acks */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+    c->s = s;
+    c->fd = fd;
+    s->busy = s->ring = 1;
+    if (fd_epollfd && (unsigned long) fd < fd_epollfd_len)
+        fd_epollfd[fd] = w->wakefd;
+    c->next = w->conns;
+    if (w->conns) w->conns->prev = c;
+    w->conns = c;
+    if (uring_recv(&w->ring, fd, RING_TAG(c, RING_RECV)) == -1) {
+        ring_close(w, c);
+        return;
+    }
+    c->receiving = 1;
+    DEBUG("Connection on fd %d\n", fd);
+}
+
+
+/*
+ * Handle the requests in a buffer received, which is given back right away.
+ * A closed or failed connection is answered before being shut down
+ */
+static void ring_received(ring_worker *w, ring_conn *c, struct io_uring_cqe *cqe) {
+    char *buf = uring_buffer(&w->ring, cqe);
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        c->receiving = 0;
+    if (cqe->res > 0 && buf && !c->quitting && !c->closing) {
+        if (session_append(c->s, buf, cqe->res) == -1
+                || handle_requests(c->s, instance.el.server_handler, 0) == 1)
+            c->quitting = 1;
+        ring_pend(w, c);
+    }
+    uring_recycle(&w->ring, cqe);
+
+    if (cqe->res == 0) {
+        c->quitting = 1;
+        ring_pend(w, c);
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        ring_close(w, c);
+        return;
+    }
+    if (c->closing) {
+        ring_close(w, c);
+    } else if (!c->receiving && !c->quitting) {
+        /* Ran out of buffers, these were given back meanwhile */
+        if (uring_recv(&w->ring, c->fd, RING_TAG(c, RING_RECV)) == -1)
+            ring_close(w, c);
+        else
+            c->receiving = 1;
+    }
+}
+
+
+static void ring_sent(ring_worker *w, ring_conn *c, struct io_uring_cqe *cqe) {
+    c->sending = 0;
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        ring_close(w, c);
+        return;
+    }
+    if (cqe->res > 0)
+        session_sent(c->s, cqe->res);
+    /* Send what's left or what was queued meanwhile */
+    ring_pend(w, c);
+}
+
+
+/*
+ * Queue a send for every pending connection with replies waiting, gathering
+ * them in a single message, they're all submitted with the next wait
+ */
+static void ring_flush(ring_worker *w) {
+    ring_conn *c = w->pending;
+    w->pending = NULL;
+    while (c) {
+        ring_conn *next = c->next_pending;
+        c->pending = 0;
+        if (c->closing) {
+            ring_close(w, c);
+        } else if (!c->sending) {
+            int n = session_gather(c->s, c->iov, SESSION_IOV_MAX);
+            if (n > 0) {
+                c->msg.msg_iov = c->iov;
+                c->msg.msg_iovlen = n;
+                if (uring_sendmsg(&w->ring, c->fd, &c->msg,
+                            RING_TAG(c, RING_SEND)) == -1)
+                    ring_close(w, c);
+                else
+                    c->sending = 1;
+            } else if (c->quitting) {
+                ring_close(w, c);
+            }
+        }
+        c = next;
+    }
+}
+
+
+/*
+ * Serve the clients accepted on listenfd with an io_uring instance. Every
+ * round reaps all the completions, handling the requests received, then
+ * queues the sends of all the replies and submits them with a single call,
+ * which also waits for the next completions. Return -1 if io_uring is not
+ * available, before accepting anything
+ */
+static int uring_worker(int listenfd) {
+    ring_worker w = { .listenfd = listenfd, .wakefd = -1, .accepting = 1 };
+    if (uring_init(&w.ring) == -1)
+        return -1;
+    if ((w.wakefd = eventfd(0, 0)) == -1
+            || uring_accept(&w.ring, listenfd, RING_ACCEPT) == -1
+            || uring_read(&w.ring, w.wakefd, &w.wakeval,
+                sizeof(w.wakeval), RING_WAKE) == -1)
+        goto err;
+    ring_wakefd = w.wakefd;
+
+    for (;;) {
+        if (uring_wait(&w.ring) == -1
+                && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            perror("io_uring_enter");
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&w.ring)) != NULL) {
+            ring_conn *c = (ring_conn *) (uintptr_t) (cqe->user_data & ~RING_OP_MASK);
+            switch (cqe->user_data & RING_OP_MASK) {
+                case RING_ACCEPT:
+                    /* Multishot accept is missing, nothing was accepted yet */
+                    if (cqe->res == -EINVAL && !w.conns)
+                        goto err;
+                    if (cqe->res >= 0)
+                        ring_accept(&w, cqe->res);
+                    if (!(cqe->flags & IORING_CQE_F_MORE))
+                        w.accepting = uring_accept(&w.ring,
+                                listenfd, RING_ACCEPT) == 0;
+                    break;
+                case RING_RECV:
+                    ring_received(&w, c, cqe);
+                    break;
+                case RING_SEND:
+                    ring_sent(&w, c, cqe);
+                    break;
+                case RING_WAKE:
+                    /* Replies were pushed by another thread */
+                    for (c = w.conns; c; c = c->next)
+                        ring_pend(&w, c);
+                    uring_read(&w.ring, w.wakefd, &w.wakeval,
+                            sizeof(w.wakeval), RING_WAKE);
+                    break;
+            }
+            uring_cqe_seen(&w.ring);
+        }
+        ring_flush(&w);
+        /*
+         * Re-arming accept found the ring full, retry now that the round is
+         * reaped, and every round after that while clients are served. With
+         * none left, fall back to epoll as a failed first arm does
+         */
+        if (!w.accepting
+                && !(w.accepting = uring_accept(&w.ring, listenfd, RING_ACCEPT) == 0)
+                && !w.conns) {
+            ERROR("io_uring: accept can't be armed again\n");
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    ring_wakefd = -1;
+    if (w.wakefd >= 0) close(w.wakefd);
+    uring_release(&w.ring);
+    return -1;
+}
+
+
 static void *worker(void *args) {
 
-    int done = 0;
+    worker_conf *conf = (worker_conf *) args;
+    int epollfd = conf->epollfd;
+    int listenfd = conf->listenfd;
+    numa_pin(conf->cpu);
+    free(conf);
+    if (instance.el.backend == BACKEND_URING && listenfd >= 0) {
+        if (uring_worker(listenfd) == 0)
+            return NULL;
+        fprintf(stderr, "io_uring not available, falling back to epoll\n");
+    }
+    if (listenfd >= 0)
+        ADD_FD_ET(epollfd, listenfd);
+
     struct epoll_event *events = calloc(instance.el.max_events, sizeof(*events));
     if (events == NULL) {
         perror("calloc(3) failed when attempting to allocate events buffer");
@@ -214,43 +649,29 @@ static void *worker(void *args) {
 
     int events_cnt;
     while ((events_cnt =
-				epoll_wait(instance.el.bepollfd, events, instance.el.max_events, -1)) > 0) {
+				epoll_wait(epollfd, events, instance.el.max_events, -1)) > 0) {
         for (int i = 0; i < events_cnt; i++) {
+            int fd = events[i].data.fd;
+            if (fd < 0)
+                continue;
+            if (fd == listenfd) {
+                accept_clients(listenfd, epollfd);
+                continue;
+            }
 
 			if ((events[i].events & EPOLLERR) ||
 					(events[i].events & EPOLLHUP)) {
 				/* An error has occured on this fd */
 				fprintf(stderr, "worker epoll error\n");
-				close(events[i].data.fd);
+				close_connection(fd);
 				continue;
 			}
 
-            if (events[i].events & EPOLLIN) {
-                /* There's some data to be processed */
-                if (events[i].data.fd < 0)
-                    continue;
-                done = (instance.el.server_handler)(events[i].data.fd);
-                if (done == END || done == 1) {
-                    /* close the connection */
-                    DEBUG("Closing connection\n");
-                    close(events[i].data.fd);
-					// TODO: remove fd from epoll
-                }
-            } else if (events[i].events & EPOLLOUT) {
-
-				peer_t *p = (peer_t *) events[i].data.ptr;
-                if (instance.verbose) {
-				    DEBUG("Answering to client from worker %d\n", p->fd);
-                }
-                SET_FD_IN(instance.el.bepollfd, p->fd);
-
-                if (send_all(p->fd, p->data, (int *) &p->size) < 0)
-                    perror("Send data failed");
-
-                /* Check if struct udata contains allocated memory */
-                if (p->alloc == 1) free(p->data);
-                free(p);
-            }
+            /* Data to be processed or replies to be sent */
+            session *s = session_get(fd);
+            if (!s || serve_connection(s, epollfd, events[i].events,
+                        instance.el.server_handler, 0) == 1)
+                close_connection(fd);
         }
     }
 
@@ -265,6 +686,92 @@ static void *worker(void *args) {
 }
 
 
+/*
+ * Return the epoll instance serving a client descriptor
+ */
+static int client_epollfd(int fd) {
+    if (fd_epollfd && fd >= 0 && (unsigned long) fd < fd_epollfd_len)
+        return fd_epollfd[fd];
+    return instance.el.bepollfd;
+}
+
+
+/*
+ * Pick the workers of a new client connection. In NUMA mode it goes to the
+ * node of the CPU that received its packets, as reported by SO_INCOMING_CPU,
+ * so that its socket buffers and requests are handled on the same node, or
+ * round robin across the nodes if unknown
+ */
+static int assign_epollfd(int fd) {
+    static unsigned int next;
+    if (!node_epollfd || fd < 0 || (unsigned long) fd >= fd_epollfd_len)
+        return instance.el.bepollfd;
+
+    int node = -1;
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+        node = numa_node_of_cpu(cpu);
+#endif
+    if (node < 0)
+        node = next++ % numa_nodes();
+    fd_epollfd[fd] = node_epollfd[node];
+    return node_epollfd[node];
+}
+
+
+/*
+ * Allocate the table of the epoll instances serving the client descriptors,
+ * all of them start on the shared one. Return -1 on failure
+ */
+static int init_fd_epollfd(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return -1;
+    fd_epollfd_len = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20)
+        ? (1 << 20) : rl.rlim_cur;
+    fd_epollfd = malloc(fd_epollfd_len * sizeof(int));
+    if (!fd_epollfd)
+        return -1;
+    for (unsigned long i = 0; i < fd_epollfd_len; i++)
+        fd_epollfd[i] = instance.el.bepollfd;
+    return 0;
+}
+
+
+/*
+ * Setup an epoll instance for the workers of every NUMA node, return -1 if
+ * NUMA mode is disabled or couldn't be setup, all the workers then share
+ * the same instance
+ */
+static int init_numa_epoll(void) {
+    int nodes = numa_nodes();
+    /* Every node needs a worker to serve the connections steered to it */
+    if (nodes == 0 || instance.el.epoll_workers < nodes
+            || init_fd_epollfd() == -1)
+        return -1;
+
+    node_epollfd = malloc(nodes * sizeof(int));
+    if (!node_epollfd)
+        goto err;
+    for (int i = 0; i < nodes; i++) {
+        if ((node_epollfd[i] = epoll_create1(0)) == -1) {
+            while (i-- > 0) close(node_epollfd[i]);
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    perror("NUMA epoll setup");
+    free(fd_epollfd);
+    free(node_epollfd);
+    fd_epollfd = node_epollfd = NULL;
+    return -1;
+}
+
+
 static void handle_connection(int fd, int server, int bus) {
     int accept_socket;
     struct sockaddr addr;
@@ -280,11 +787,15 @@ static void handle_connection(int fd, int server, int bus) {
             sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
 
     set_nonblocking(accept_socket);
+    /* Start from a clean state, the descriptor may have been used before */
+    session_close(accept_socket);
 
     /* Client connection check, this case must add the descriptor
        to the next worker thread in the list */
     if (fd == server) {
-        ADD_FD(instance.el.bepollfd, accept_socket);
+        /* Pipelined replies are sent as they come, don't wait for acks */
+        setsockopt(accept_socket, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+        ADD_FD(assign_epollfd(accept_socket), accept_socket);
         SET_FD_IN(instance.el.epollfd, server);
         DEBUG("Connection %s:%s\n", hbuf, sbuf);
     }
@@ -300,44 +811,35 @@ static void handle_connection(int fd, int server, int bus) {
 }
 
 
-static int handle_input(int fd) {
-    /* There's some data from peer nodes to be processed, check if
-     * the lock is released (i.e. the cluster has succesfully formed) and handle
-     * incoming messages
-     */
-    int done = 0;
-    if (instance.lock == 0) {
-        if (instance.verbose) DEBUG("Handling request from %d\n", fd);
-        done = (instance.el.cluster_handler)(fd);
-        if (done == END) {
-            /* close the connection */
-            DEBUG("Closing connection\n");
-            close(fd);
-            return -1;
-        }
+/*
+ * There's some data from peer nodes to be processed or replies to send them,
+ * incoming messages are handled only once the lock is released (i.e. the
+ * cluster has succesfully formed). Return -1 if the connection was closed
+ */
+static int handle_peer(int fd, uint32_t events) {
+    if ((events & EPOLLIN) && instance.lock != 0)
+        return 0;
+    if (instance.verbose) DEBUG("Handling request from %d\n", fd);
+    session *s = session_get(fd);
+    if (!s || serve_connection(s, instance.el.epollfd, events,
+                instance.el.cluster_handler, 1) == 1) {
+        close_connection(fd);
+        return -1;
     }
     return 0;
 }
 
 
-static void handle_output(void *ptr) {
-    peer_t *p = (peer_t *) ptr;
-    if (instance.verbose) DEBUG("Send to fd %d\n", p->fd);
-    SET_FD_IN(instance.el.epollfd, p->fd);
-    if (send_all(p->fd, p->data, (int *) &p->size) < 0)
-        perror("Send data failed");
-    /* Check if struct udata contains allocated memory */
-    if (p->alloc == 1) free(p->data);
-    free(p);
-}
-
-
 /*
  * Main event loop thread, awaits for incoming connections using the global
  * epoll instance, his main responsibility is to pass incoming client
  * connections descriptor to a worker thread according to a simple round robin
  * scheduling, other than this, it is the sole responsible of the communication
- * between nodes if the system is started in cluster mode.
+ * between nodes if the system is started in cluster mode. In reuseport mode
+ * every worker listens on the client port with a socket and an epoll instance
+ * of its own instead, the kernel spreads the new connections across them and
+ * each one stays on its worker for life, registered once and never re-armed.
+ * NUMA pinning of the workers still applies.
  */
 int start_loop(void) {
     struct epoll_event *events = calloc(instance.el.max_events, sizeof(*events));
@@ -349,8 +851,10 @@ int start_loop(void) {
      * - one for incoming client connections
      * - a second for intercommunication between nodes
      */
+    /* The io_uring workers accept their own clients */
+    int reuseport = instance.el.reuseport || instance.el.backend == BACKEND_URING;
     int fds[2] = {
-        listento(instance.el.host, instance.el.server_port),
+        reuseport ? -1 : listento(instance.el.host, instance.el.server_port),
         listento(instance.el.host, instance.el.cluster_port)
     };
     /* worker thread pool */
@@ -360,8 +864,28 @@ int start_loop(void) {
        his event queue. Every  worker_epoll is added to a list, in order to
        reuse them in the event loop to add connecting descriptors in a round
        robin scheduling */
-    for (int i = 0; i < instance.el.epoll_workers; ++i)
-        pthread_create(&workers[i], NULL, worker, NULL);
+    if (reuseport && init_fd_epollfd() == -1) {
+        perror("reuseport setup");
+        exit(EXIT_FAILURE);
+    }
+    int numa = !reuseport && init_numa_epoll() == 0;
+    for (int i = 0; i < instance.el.epoll_workers; ++i) {
+        worker_conf *conf = malloc(sizeof(worker_conf));
+        conf->listenfd = -1;
+        if (reuseport) {
+            if ((conf->epollfd = epoll_create1(0)) == -1) {
+                perror("epoll_create1");
+                exit(EXIT_FAILURE);
+            }
+            conf->listenfd = listento(instance.el.host, instance.el.server_port);
+            conf->cpu = numa_worker_cpu(i);
+        } else {
+            conf->epollfd = numa
+                ? node_epollfd[i % numa_nodes()] : instance.el.bepollfd;
+            conf->cpu = numa ? numa_worker_cpu(i) : -1;
+        }
+        pthread_create(&workers[i], NULL, worker, conf);
+    }
 
     int nfds;
 
@@ -369,7 +893,8 @@ int start_loop(void) {
        one represent the main point of access for clients, the second one is
        responsible for the communication between nodes (bus) */
     for (int n = 0; n < 2; ++n) {
-        ADD_FD(instance.el.epollfd, fds[n]);
+        if (fds[n] >= 0)
+            ADD_FD(instance.el.epollfd, fds[n]);
 	}
     /* Start the main event loop, epoll_wait blocks until an event occur */
     while (1) {
@@ -385,7 +910,7 @@ int start_loop(void) {
                 /* An error has occured on this fd, or the socket is not
                    ready for reading */
                 perror ("epoll error");
-                close(events[i].data.fd);
+                close_connection(events[i].data.fd);
                 continue;
             }
             /* If fdescriptor is main server or bus server add it to worker
@@ -393,12 +918,8 @@ int start_loop(void) {
             if (events[i].data.fd == fds[0]
                     || events[i].data.fd == fds[1]) {
                 handle_connection(events[i].data.fd, fds[0], fds[1]);
-            } else if (events[i].events & EPOLLIN) {
-                if (handle_input(events[i].data.fd) == -1)
-                    break;
-            }
-            else if (events[i].events & EPOLLOUT) {
-                handle_output(events[i].data.ptr);
+            } else {
+                handle_peer(events[i].data.fd, events[i].events);
             }
         }
     }
@@ -408,19 +929,35 @@ int start_loop(void) {
 
 
 /*
- * Add peer_t structure to the global write queue, a writer worker will
- * handle it
+ * Queue a reply on the connection it's addressed to, it's sent by the thread
+ * serving the connection
  */
 void schedule_write(peer_t *p) {
-	if (p->tocli == 0) {
-        if (instance.verbose) {
-            DEBUG("Scheduled write to peer fd: %d\n", p->fd);
-        }
-        SET_FD_OUT(instance.el.epollfd, p->fd, p);
-    } else {
-        if (instance.verbose) {
-            DEBUG("Scheduled write to client\n");
-        }
-        SET_FD_OUT(instance.el.bepollfd, p->fd, p);
+    int epollfd = p->tocli ? client_epollfd(p->fd) : instance.el.epollfd;
+    if (instance.verbose) {
+        DEBUG("Scheduled write to %s fd: %d\n", p->tocli ? "client" : "peer", p->fd);
+    }
+    session *s = session_get(p->fd);
+    if (!s) {
+        if (send_all(p->fd, p->data, (int *) &p->size) < 0)
+            perror("Send data failed");
+        peer_free(p);
+        return;
     }
+    session_push(s, p, epollfd);
+    /* An io_uring worker sends its own replies, others must wake it up */
+    if (s->ring && epollfd != ring_wakefd)
+        eventfd_write(epollfd, 1);
+}
+
+
+/*
+ * Return the backend matching a name, epoll or io_uring, or -1 if there's none
+ */
+int event_backend(const char *name) {
+    if (strcasecmp(name, "epoll") == 0)
+        return BACKEND_EPOLL;
+    if (strcasecmp(name, "io_uring") == 0 || strcasecmp(name, "uring") == 0)
+        return BACKEND_URING;
+    return -1;
 }
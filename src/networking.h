@@ -31,12 +31,16 @@
 #define MAX_EVENTS	  64
 #define BUFSIZE		  2048
 
+/* Event loop backends of the workers serving the clients */
+#define BACKEND_EPOLL 0
+#define BACKEND_URING 1
+
 
 /*
- * File descriptor handler, a functor used when incoming data from clients must
- * be handled
+ * Request handler, a functor called with the descriptor of a connection and a
+ * complete request read from it
  */
-typedef int (*fd_handler)(int, int);
+typedef int (*fd_handler)(int, char *);
 
 
 typedef struct peer {
@@ -45,6 +49,7 @@ typedef struct peer {
     unsigned int alloc : 1;
 	unsigned int tocli : 1;
     char *data;
+    struct peer *next;           /* next reply queued on the connection */
 } peer_t;
 
 
@@ -57,8 +62,10 @@ typedef struct {
 	int bufsize;				 /* buffer size for reading data from sockets */
     int epollfd;                 /* file descriptor for epoll */
 	int bepollfd;				 /* file descriptor for epoll on the bus */
-	int (*cluster_handler)(int); /* function pointer to cluster communication implementation function */
-	int (*server_handler)(int);  /* function pointer to client-server communication implementation function */
+	int reuseport;				 /* every worker accepts clients on its own socket */
+	int backend;				 /* BACKEND_EPOLL or BACKEND_URING */
+	fd_handler cluster_handler;  /* function pointer to cluster communication implementation function */
+	fd_handler server_handler;   /* function pointer to client-server communication implementation function */
 } event_loop;
 
 
@@ -68,6 +75,7 @@ int set_nonblocking(int);
 int listento(const char *, const char *);
 int connectto(const char *, const char *);
 int start_loop();
+int event_backend(const char *);
 void schedule_write(peer_t *);
 
 #endif
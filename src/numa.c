@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+
+/* Memory policy of mbind(2), pages go to the node unless it's full */
+#define MPOL_PREFERRED      1
+
+#define NODE_PATH           "/sys/devices/system/node"
+
+
+static int nnodes;
+static int cpu_node[NUMA_MAX_CPUS];
+/* CPUs of every node in ascending order, workers are spread across them */
+static int node_cpus[NUMA_MAX_NODES][NUMA_MAX_CPUS];
+static int node_ncpus[NUMA_MAX_NODES];
+/* Node ids may have holes, nodes are numbered in order of appearance */
+static int node_ids[NUMA_MAX_NODES];
+
+
+/*
+ * Parse a list like 0-3,8,10-11 as found in sysfs, marking every number up
+ * to max found in set. Return the number of items marked
+ */
+static int parse_list(const char *s, char *set, int max) {
+    int count = 0;
+    while (*s && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s) return count;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s) return count;
+        }
+        for (long i = lo; i <= hi && i < max; i++) {
+            if (i >= 0 && !set[i]) {
+                set[i] = 1;
+                count++;
+            }
+        }
+        s = *end == ',' ? end + 1 : end;
+        if (*end != ',') break;
+    }
+    return count;
+}
+
+
+static int read_list(const char *path, char *set, int max) {
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int count = fgets(buf, sizeof(buf), f) ? parse_list(buf, set, max) : 0;
+    fclose(f);
+    return count;
+}
+
+
+/*
+ * Read the topology of the machine, return the number of nodes or 0 if
+ * there's a single one, in which case NUMA placement is disabled
+ */
+int numa_init(void) {
+    char online[NUMA_MAX_NODES] = {0}, path[128];
+    nnodes = 0;
+    for (int i = 0; i < NUMA_MAX_CPUS; i++)
+        cpu_node[i] = -1;
+
+    if (read_list(NODE_PATH "/online", online, NUMA_MAX_NODES) < 2)
+        return 0;
+
+    for (int id = 0; id < NUMA_MAX_NODES; id++) {
+        if (!online[id]) continue;
+        char cpus[NUMA_MAX_CPUS] = {0};
+        snprintf(path, sizeof(path), NODE_PATH "/node%d/cpulist", id);
+        /* Memory-only nodes get no worker */
+        if (read_list(path, cpus, NUMA_MAX_CPUS) == 0) continue;
+        node_ids[nnodes] = id;
+        node_ncpus[nnodes] = 0;
+        for (int c = 0; c < NUMA_MAX_CPUS; c++) {
+            if (!cpus[c]) continue;
+            cpu_node[c] = nnodes;
+            node_cpus[nnodes][node_ncpus[nnodes]++] = c;
+        }
+        nnodes++;
+    }
+
+    if (nnodes < 2) nnodes = 0;
+    return nnodes;
+}
+
+
+/*
+ * Return the number of nodes with CPUs, 0 if NUMA placement is disabled
+ */
+int numa_nodes(void) {
+    return nnodes;
+}
+
+
+/*
+ * Return the node of a CPU, -1 if unknown or NUMA placement is disabled
+ */
+int numa_node_of_cpu(int cpu) {
+    if (nnodes == 0 || cpu < 0 || cpu >= NUMA_MAX_CPUS) return -1;
+    return cpu_node[cpu];
+}
+
+
+/*
+ * Return the CPU to pin the i-th worker to, workers alternate between the
+ * nodes so that every node gets its share. -1 if NUMA placement is disabled
+ */
+int numa_worker_cpu(unsigned int i) {
+    if (nnodes == 0) return -1;
+    int node = i % nnodes;
+    return node_cpus[node][(i / nnodes) % node_ncpus[node]];
+}
+
+
+/*
+ * Pin the calling thread to a CPU, nothing happens for a negative one
+ */
+int numa_pin(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+
+/*
+ * Prefer a node for the pages of a memory range not yet touched, any other
+ * node is used once it's full. Nothing happens for a negative node
+ */
+int numa_bind(void *addr, size_t len, int node) {
+    if (nnodes == 0 || node < 0 || node >= nnodes) return -1;
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    int id = node_ids[node];
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+            NUMA_MAX_NODES + 1, 0);
+}
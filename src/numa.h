@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+
+/* Max number of NUMA nodes and CPUs taken into account */
+#define NUMA_MAX_NODES      64
+#define NUMA_MAX_CPUS       1024
+
+
+/*
+ * NUMA placement, the topology is read from sysfs and memory is bound with
+ * raw syscalls, so no library is needed. Everything degrades to a no-op
+ * when the machine has a single node or the topology can't be read: there
+ * numa_nodes returns 0 and the other calls do nothing
+ */
+
+/* NUMA API */
+int numa_init(void);
+int numa_nodes(void);
+int numa_node_of_cpu(int);
+int numa_worker_cpu(unsigned int);
+int numa_pin(int);
+int numa_bind(void *, size_t, int);
+
+#endif
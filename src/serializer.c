@@ -39,7 +39,7 @@
 char *serialize(struct message msg) {
     int mlen = strlen(msg.content);
     int flen = sizeof(int) + sizeof(unsigned int) + mlen ; // structure whole len
-    char *serialized = malloc(sizeof(char) * (flen + sizeof(int))); // serialization whole len
+    char *serialized = malloc(sizeof(char) * (flen + sizeof(int) + 1)); // serialization whole len, terminator included
     char *metadata = serialized;
     char *fd = serialized + sizeof(int);        // space for descriptor
     char *fp = fd + sizeof(int);                // space for flag
@@ -65,6 +65,8 @@ struct message deserialize(char *serialized_msg) {
     msg.fd = *((int *) fd);
     msg.ready = *((unsigned int *) fp);
     msg.content = malloc((mlen + 1) * sizeof(char));
-    strcpy(msg.content, content);
+    /* Messages are cut out of a stream, the content isn't terminated */
+    memcpy(msg.content, content, mlen);
+    msg.content[mlen] = '\0';
     return msg;
 }
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "session.h"
+#include "serializer.h"
+#include "event.h"
+
+
+/*
+ * Sessions are found by file descriptor. They're created on the first use of
+ * a descriptor and never freed, only reset when the connection is closed, so
+ * that a reply pushed by another thread racing with the close never touches
+ * released memory
+ */
+static session **sessions;
+static unsigned long sessions_len;
+
+
+/*
+ * Allocate the table of sessions, one slot for every descriptor the process
+ * may open. Return -1 on failure
+ */
+int session_init(void) {
+    struct rlimit rl;
+    if (sessions) return 0;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return -1;
+    sessions_len = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20)
+        ? (1 << 20) : rl.rlim_cur;
+    sessions = calloc(sessions_len, sizeof(session *));
+    return sessions ? 0 : -1;
+}
+
+
+/*
+ * Return the session of a descriptor, creating it if needed, or NULL if the
+ * descriptor is out of range or memory is exhausted
+ */
+session *session_get(int fd) {
+    if (!sessions || fd < 0 || (unsigned long) fd >= sessions_len)
+        return NULL;
+    session *s = __atomic_load_n(&sessions[fd], __ATOMIC_ACQUIRE);
+    if (s) return s;
+
+    s = calloc(1, sizeof(session));
+    if (!s) return NULL;
+    s->fd = fd;
+    pthread_mutex_init(&s->lock, NULL);
+    session *expected = NULL;
+    if (!__atomic_compare_exchange_n(&sessions[fd], &expected, s, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* Another thread created it first */
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return expected;
+    }
+    return s;
+}
+
+
+void peer_free(peer_t *p) {
+    /* Check if struct udata contains allocated memory */
+    if (p->alloc == 1) free(p->data);
+    free(p);
+}
+
+
+/*
+ * Drop the requests and replies left on a connection being closed, must be
+ * called before closing the descriptor, which may be reused right after
+ */
+void session_close(int fd) {
+    if (!sessions || fd < 0 || (unsigned long) fd >= sessions_len)
+        return;
+    session *s = __atomic_load_n(&sessions[fd], __ATOMIC_ACQUIRE);
+    if (!s) return;
+
+    pthread_mutex_lock(&s->lock);
+    peer_t *p = s->out_head;
+    s->out_head = s->out_tail = NULL;
+    free(s->buf);
+    s->buf = NULL;
+    s->len = s->cap = s->pos = s->scan = s->out_off = 0;
+    s->busy = s->broken = s->persistent = s->ring = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    while (p) {
+        peer_t *next = p->next;
+        peer_free(p);
+        p = next;
+    }
+}
+
+
+/*
+ * Make room for at least room more bytes at the end of the input buffer.
+ * Return -1 with errno EMSGSIZE if a request is larger than
+ * SESSION_INPUT_MAX, or ENOMEM
+ */
+static int session_reserve(session *s, size_t room) {
+    if (s->cap - s->len >= room)
+        return 0;
+    if (s->pos > 0)
+        session_compact(s);
+    size_t cap = s->cap ? s->cap : BUFSIZE;
+    while (cap - s->len < room)
+        cap *= 2;
+    if (cap == s->cap)
+        return 0;
+    if (cap > SESSION_INPUT_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    char *buf = realloc(s->buf, cap);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    s->buf = buf;
+    s->cap = cap;
+    return 0;
+}
+
+
+/*
+ * Read once from fd at the end of the input buffer, making room first.
+ * Return the bytes read, 0 once the peer closed the connection or -1 on
+ * error, with errno EAGAIN if there's nothing left to read or EMSGSIZE if a
+ * request is larger than SESSION_INPUT_MAX
+ */
+int session_fill(session *s, int fd) {
+    if (session_reserve(s, BUFSIZE / 2) == -1)
+        return -1;
+    /* Peer sockets may be blocking, never wait for more data */
+    ssize_t n = recv(fd, s->buf + s->len, s->cap - s->len, MSG_DONTWAIT);
+    if (n > 0) s->len += n;
+    return n;
+}
+
+
+/*
+ * Append bytes received by other means to the input buffer. Return -1 with
+ * errno set as session_fill does
+ */
+int session_append(session *s, const char *data, size_t len) {
+    if (session_reserve(s, len) == -1)
+        return -1;
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+    return 0;
+}
+
+
+/*
+ * Cut the next complete line out of the input buffer, terminating it in
+ * place of its line ending, either \n or \r\n. Return NULL if only a partial
+ * line is left. The line stays valid until the next fill or compaction
+ */
+char *session_line(session *s) {
+    char *nl = s->scan < s->len
+        ? memchr(s->buf + s->scan, '\n', s->len - s->scan) : NULL;
+    if (!nl) {
+        /* Don't scan the same bytes again on the next fill */
+        s->scan = s->len;
+        return NULL;
+    }
+    char *line = s->buf + s->pos;
+    *nl = '\0';
+    if (nl > line && nl[-1] == '\r')
+        nl[-1] = '\0';
+    s->pos = s->scan = nl + 1 - s->buf;
+    return line;
+}
+
+
+/*
+ * Cut the next complete serialized message out of the input buffer, its
+ * length is read from the header. Return NULL if only a partial one is left,
+ * setting broken if the header can't be valid
+ */
+char *session_frame(session *s) {
+    size_t avail = s->len - s->pos;
+    if (avail < S_OFFSET)
+        return NULL;
+    int mlen;
+    memcpy(&mlen, s->buf + s->pos, sizeof(int));
+    if (mlen < 0 || (size_t) mlen > SESSION_INPUT_MAX - S_OFFSET) {
+        s->broken = 1;
+        return NULL;
+    }
+    if (avail < S_OFFSET + mlen)
+        return NULL;
+    char *frame = s->buf + s->pos;
+    s->pos += S_OFFSET + mlen;
+    s->scan = s->pos;
+    return frame;
+}
+
+
+/*
+ * Move the partial request left to the start of the input buffer, releasing
+ * or shrinking the buffer if a burst made it grow much larger than needed
+ */
+void session_compact(session *s) {
+    if (s->pos == s->len) {
+        s->len = s->pos = s->scan = 0;
+        if (s->cap > SESSION_BUF_IDLE_MAX) {
+            free(s->buf);
+            s->buf = NULL;
+            s->cap = 0;
+        }
+        return;
+    }
+    if (s->pos > 0) {
+        memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->scan -= s->pos;
+        s->pos = 0;
+    }
+    if (s->cap > SESSION_BUF_IDLE_MAX && s->len * 4 < s->cap) {
+        size_t cap = s->cap;
+        while (cap > BUFSIZE && s->len * 4 < cap)
+            cap /= 2;
+        char *buf = realloc(s->buf, cap);
+        if (buf) {
+            s->buf = buf;
+            s->cap = cap;
+        }
+    }
+}
+
+
+/*
+ * Wake up the thread owning a connection on epollfd to write its replies
+ */
+static void session_arm_out(session *s, int epollfd) {
+    if (s->persistent)
+        KICK_FD(epollfd, s->fd);
+    else
+        SET_FD_OUT(epollfd, s->fd, NULL);
+}
+
+
+/*
+ * Queue a reply on a connection, armed for writing on epollfd unless a
+ * thread is already serving it, which will do it once done
+ */
+void session_push(session *s, peer_t *p, int epollfd) {
+    p->next = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->out_tail) s->out_tail->next = p;
+    else s->out_head = p;
+    s->out_tail = p;
+    if (!s->busy)
+        session_arm_out(s, epollfd);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/*
+ * Mark a connection as being served by the calling thread. Return -1 if
+ * another thread is already serving it, a reply pushed meanwhile may have
+ * re-armed it, the event must then be dropped as the owner arms it again
+ * once done
+ */
+int session_acquire(session *s) {
+    int ret = 0;
+    pthread_mutex_lock(&s->lock);
+    if (s->busy)
+        ret = -1;
+    else
+        s->busy = 1;
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+
+/*
+ * Point iov to the unsent part of the first max replies queued, return how
+ * many. They stay queued until reported sent with session_sent
+ */
+int session_gather(session *s, struct iovec *iov, int max) {
+    int n = 0;
+    pthread_mutex_lock(&s->lock);
+    for (peer_t *p = s->out_head; p && n < max; p = p->next, n++) {
+        size_t off = n == 0 ? s->out_off : 0;
+        iov[n].iov_base = p->data + off;
+        iov[n].iov_len = p->size - off;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+
+/*
+ * Drop the replies sent from the queue, the last one may be sent only in
+ * part
+ */
+void session_sent(session *s, size_t sent) {
+    peer_t *done = NULL;
+    pthread_mutex_lock(&s->lock);
+    while (sent > 0 && s->out_head) {
+        peer_t *p = s->out_head;
+        size_t left = p->size - s->out_off;
+        if (sent < left) {
+            s->out_off += sent;
+            break;
+        }
+        sent -= left;
+        s->out_off = 0;
+        s->out_head = p->next;
+        if (!s->out_head) s->out_tail = NULL;
+        p->next = done;
+        done = p;
+    }
+    pthread_mutex_unlock(&s->lock);
+    while (done) {
+        peer_t *next = done->next;
+        peer_free(done);
+        done = next;
+    }
+}
+
+
+/*
+ * Write the replies queued on a connection, as many as fit at once with a
+ * single gathering call, until the queue is empty or the socket is full.
+ * Must be called by the thread serving the connection. Return 0 once
+ * everything was sent, 1 if the socket is full and the rest must wait for
+ * it to be writable, -1 on error
+ */
+int session_flush(session *s) {
+    struct iovec iov[SESSION_IOV_MAX];
+    struct msghdr msg = { .msg_iov = iov };
+
+    for (;;) {
+        int n = session_gather(s, iov, SESSION_IOV_MAX);
+        if (n == 0)
+            return 0;
+
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(s->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        session_sent(s, sent);
+    }
+}
+
+
+/*
+ * Hand a connection back to epollfd once served, armed for writing if
+ * replies are waiting and for reading otherwise. A persistent connection
+ * stays registered, it's only kicked if replies are left, the kick is
+ * reported once the socket can take them
+ */
+void session_release(session *s, int epollfd) {
+    pthread_mutex_lock(&s->lock);
+    s->busy = 0;
+    if (s->out_head)
+        session_arm_out(s, epollfd);
+    else if (!s->persistent)
+        SET_FD_IN(epollfd, s->fd);
+    pthread_mutex_unlock(&s->lock);
+}
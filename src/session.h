@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "networking.h"
+
+
+/* Input buffers larger than this are released once drained */
+#define SESSION_BUF_IDLE_MAX    (16 * 1024)
+/* Largest request accepted, a connection sending more is closed */
+#define SESSION_INPUT_MAX       (64 * 1024 * 1024)
+/* Replies gathered by a single write */
+#define SESSION_IOV_MAX         64
+
+
+/*
+ * State of a connection, client or peer node. Bytes read are appended to
+ * buf and requests are cut out of it in place from pos, a partial request
+ * at the end stays there until the rest arrives. The buffer grows to hold
+ * the largest request and shrinks back once drained. Replies wait in the
+ * out queue until written together, out_off bytes of the first one are
+ * already sent. Busy is set while a thread is reading from or writing to
+ * the connection, so that replies pushed meanwhile don't re-arm it under its
+ * feet and no other thread serves it at the same time. A persistent
+ * connection is registered once for good by the thread owning it and only
+ * needs a kick when replies are pushed by other threads.
+ * A ring connection is served by an io_uring worker, which keeps it busy for
+ * its whole life and sends the replies itself
+ */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+    size_t scan;
+    unsigned int busy : 1;
+    unsigned int broken : 1;
+    unsigned int persistent : 1;
+    unsigned int ring : 1;
+    pthread_mutex_t lock;
+    peer_t *out_head;
+    peer_t *out_tail;
+    size_t out_off;
+} session;
+
+
+/* Session API */
+int session_init(void);
+session *session_get(int);
+void session_close(int);
+int session_fill(session *, int);
+int session_append(session *, const char *, size_t);
+char *session_line(session *);
+char *session_frame(session *);
+void session_compact(session *);
+void session_push(session *, peer_t *, int);
+int session_acquire(session *);
+int session_gather(session *, struct iovec *, int);
+void session_sent(session *, size_t);
+int session_flush(session *);
+void session_release(session *, int);
+void peer_free(peer_t *);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "skiplist.h"
+#include "slab.h"
+#include "util.h"
+#include "map.h"
+
+
+/* One node out of SKIPLIST_BRANCH is promoted to the next level */
+#define SKIPLIST_BRANCH     4
+
+
+static inline uint64_t skiplist_rand(void) {
+    static __thread uint64_t state;
+    if (!state) state = (uintptr_t) &state | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * Draw the level of a new node, every level is SKIPLIST_BRANCH times less
+ * likely than the previous one. Two random bits decide each level
+ */
+static unsigned int skiplist_level(void) {
+    uint64_t r = skiplist_rand();
+    unsigned int level = 1;
+    while (level < SKIPLIST_MAXLEVEL && (r & (SKIPLIST_BRANCH - 1)) == 0) {
+        r >>= 2;
+        level++;
+    }
+    return level;
+}
+
+
+static skiplist_node *skiplist_node_create(unsigned int level,
+        const char *key, size_t klen, unsigned long hash) {
+    skiplist_node *n = slab_alloc(sizeof(skiplist_node)
+            + level * sizeof(skiplist_node *) + klen + 1);
+    if (!n) return NULL;
+    n->hash = hash;
+    n->klen = klen;
+    n->level = level;
+    memset(n->next, 0, level * sizeof(skiplist_node *));
+    if (key) memcpy((char *) skiplist_key(n), key, klen);
+    ((char *) skiplist_key(n))[klen] = '\0';
+    return n;
+}
+
+
+/*
+ * Compare the key of a node to key, like memcmp with shorter keys first on a
+ * common prefix
+ */
+int skiplist_compare(const skiplist_node *n, const char *key, size_t klen) {
+    size_t len = n->klen < klen ? n->klen : klen;
+    int cmp = memcmp(skiplist_key(n), key, len);
+    if (cmp != 0) return cmp;
+    return n->klen < klen ? -1 : n->klen > klen;
+}
+
+
+/*
+ * Return a new empty skiplist, or NULL on failure
+ */
+skiplist *skiplist_create(void) {
+    skiplist *sl = shb_malloc(sizeof(skiplist));
+    if (!sl) return NULL;
+    sl->head = skiplist_node_create(SKIPLIST_MAXLEVEL, NULL, 0, 0);
+    if (!sl->head) {
+        free(sl);
+        return NULL;
+    }
+    sl->level = 1;
+    sl->size = 0;
+    return sl;
+}
+
+
+/*
+ * Deallocate the skiplist and all its nodes
+ */
+void skiplist_release(skiplist *sl) {
+    if (!sl) return;
+    skiplist_node *n = sl->head;
+    while (n) {
+        skiplist_node *next = n->next[0];
+        slab_free(n);
+        n = next;
+    }
+    free(sl);
+}
+
+
+/*
+ * Fill update with the last node before key on every level, return the node
+ * that follows on the bottom one
+ */
+static skiplist_node *skiplist_find(skiplist *sl, const char *key,
+        size_t klen, skiplist_node **update) {
+    skiplist_node *n = sl->head;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (n->next[i] && skiplist_compare(n->next[i], key, klen) < 0)
+            n = n->next[i];
+        if (update) update[i] = n;
+    }
+    return n->next[0];
+}
+
+
+/*
+ * Insert a copy of key, return MAP_ERR if it's already present or the node
+ * couldn't be allocated
+ */
+int skiplist_insert(skiplist *sl, const char *key, size_t klen,
+        unsigned long hash) {
+    skiplist_node *update[SKIPLIST_MAXLEVEL];
+    skiplist_node *n = skiplist_find(sl, key, klen, update);
+    if (n && skiplist_compare(n, key, klen) == 0)
+        return MAP_ERR;
+
+    unsigned int level = skiplist_level();
+    n = skiplist_node_create(level, key, klen, hash);
+    if (!n) return MAP_ERR;
+    for (unsigned int i = sl->level; i < level; i++)
+        update[i] = sl->head;
+    if (level > sl->level)
+        sl->level = level;
+
+    for (unsigned int i = 0; i < level; i++) {
+        n->next[i] = update[i]->next[i];
+        update[i]->next[i] = n;
+    }
+    sl->size++;
+    return MAP_OK;
+}
+
+
+/*
+ * Remove key, return MAP_ERR if it's not present
+ */
+int skiplist_delete(skiplist *sl, const char *key, size_t klen) {
+    skiplist_node *update[SKIPLIST_MAXLEVEL];
+    skiplist_node *n = skiplist_find(sl, key, klen, update);
+    if (!n || skiplist_compare(n, key, klen) != 0)
+        return MAP_ERR;
+
+    for (unsigned int i = 0; i < n->level; i++)
+        update[i]->next[i] = n->next[i];
+    while (sl->level > 1 && !sl->head->next[sl->level - 1])
+        sl->level--;
+    slab_free(n);
+    sl->size--;
+    return MAP_OK;
+}
+
+
+/*
+ * Return the first node whose key is not lower than key, NULL if there's
+ * none. Following nodes are reached in order through next[0]
+ */
+skiplist_node *skiplist_seek(skiplist *sl, const char *key, size_t klen) {
+    return skiplist_find(sl, key, klen, NULL);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stddef.h>
+
+
+/* Max height of a node, enough for 4^32 keys */
+#define SKIPLIST_MAXLEVEL   32
+
+
+/*
+ * A node owns a copy of its key, stored right after its array of forward
+ * links, and caches its hash so the entry in the map can be found without
+ * hashing it again
+ */
+typedef struct skiplist_node {
+    unsigned long hash;
+    unsigned int klen;
+    unsigned int level;
+    struct skiplist_node *next[];
+} skiplist_node;
+
+
+/*
+ * Keys in lexicographic order of their bytes, head is a sentinel node as high
+ * as the highest possible one
+ */
+typedef struct {
+    skiplist_node *head;
+    unsigned int level;
+    unsigned long size;
+} skiplist;
+
+
+static inline const char *skiplist_key(const skiplist_node *n) {
+    return (const char *) &n->next[n->level];
+}
+
+
+/* Skiplist API */
+skiplist *skiplist_create(void);
+void skiplist_release(skiplist *);
+int skiplist_insert(skiplist *, const char *, size_t, unsigned long);
+int skiplist_delete(skiplist *, const char *, size_t);
+skiplist_node *skiplist_seek(skiplist *, const char *, size_t);
+int skiplist_compare(const skiplist_node *, const char *, size_t);
+
+#endif
@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+
+/* Chunk class marking a page that holds a single large allocation */
+#define LARGE_CLASS     -1
+
+/* Room reserved at the start of every page for its header */
+#define PAGE_HEADER     64
+
+/* Max bytes moved at once between a thread cache and its class */
+#define CACHE_BATCH_BYTES   (64 * 1024)
+
+/* Threads publish their count of used bytes once it drifts this much */
+#define USED_SYNC_BYTES     (64 * 1024)
+
+
+/*
+ * Header at the start of every page, the page owning a chunk is found by
+ * masking its address, chunks carry no per-allocation overhead
+ */
+typedef struct {
+    int cls;
+    size_t size;
+} slab_page;
+
+
+/*
+ * A size class, chunks returned by the threads are kept in a free list and
+ * new ones are carved from the current page when it runs dry
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t chunk_size;
+    unsigned int batch;
+    void *free_list;
+    unsigned long free_count;
+    char *next;
+    char *end;
+    unsigned long pages;
+    unsigned long chunks;
+} slab_class;
+
+
+/* Free chunks owned by a thread for a single class */
+typedef struct {
+    void *head;
+    unsigned int count;
+} slab_cache;
+
+
+static slab_class classes[SLAB_MAX_CLASSES];
+static int nclasses;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static __thread slab_cache tcache[SLAB_MAX_CLASSES];
+
+/* Pages taken by allocations too large for any class */
+static unsigned long large_pages;
+static size_t large_bytes;
+
+/*
+ * Bytes of the chunks handed out and not yet freed, every thread keeps its
+ * own delta and folds it into the shared counter only once in a while
+ */
+static long used_bytes;
+static __thread long used_delta;
+
+
+/* Free chunks are linked through their first word */
+#define NEXT(c) (*(void **) (c))
+
+
+/*
+ * Build the size classes, every chunk size is a multiple of 8 so the free
+ * list links are always aligned
+ */
+static void slab_init(void) {
+    double size = SLAB_MIN_CHUNK;
+
+    while (nclasses < SLAB_MAX_CLASSES - 1 && size < SLAB_MAX_CHUNK) {
+        size_t chunk = ((size_t) size + 7) & ~(size_t) 7;
+        if (nclasses == 0 || chunk > classes[nclasses - 1].chunk_size) {
+            pthread_mutex_init(&classes[nclasses].lock, NULL);
+            classes[nclasses++].chunk_size = chunk;
+        }
+        size *= SLAB_GROWTH_FACTOR;
+    }
+    pthread_mutex_init(&classes[nclasses].lock, NULL);
+    classes[nclasses++].chunk_size = SLAB_MAX_CHUNK;
+
+    /* Large chunks are cached by the threads in smaller numbers */
+    for (int i = 0; i < nclasses; i++) {
+        size_t batch = CACHE_BATCH_BYTES / classes[i].chunk_size;
+        if (batch > SLAB_CACHE_SIZE / 2) batch = SLAB_CACHE_SIZE / 2;
+        classes[i].batch = batch > 0 ? batch : 1;
+    }
+}
+
+
+static inline void slab_account(long bytes) {
+    used_delta += bytes;
+    if (used_delta > USED_SYNC_BYTES || used_delta < -USED_SYNC_BYTES) {
+        __atomic_add_fetch(&used_bytes, used_delta, __ATOMIC_RELAXED);
+        used_delta = 0;
+    }
+}
+
+
+/*
+ * Return the smallest class holding size bytes, or -1 if it is too large
+ * for any of them
+ */
+static int slab_class_of(size_t size) {
+    if (size > SLAB_MAX_CHUNK) return -1;
+
+    int lo = 0, hi = nclasses - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].chunk_size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+/*
+ * Map size bytes aligned to SLAB_PAGE_SIZE, the slack around the aligned
+ * region is given back right away
+ */
+static void *slab_map(size_t size) {
+    size_t len = size + SLAB_PAGE_SIZE;
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    char *start = (char *) (((uintptr_t) p + SLAB_PAGE_SIZE - 1)
+            & ~((uintptr_t) SLAB_PAGE_SIZE - 1));
+    if (start > p)
+        munmap(p, start - p);
+    if (start + size < p + len)
+        munmap(start + size, p + len - (start + size));
+    return start;
+}
+
+
+static inline slab_page *slab_page_of(void *ptr) {
+    return (slab_page *) ((uintptr_t) ptr & ~((uintptr_t) SLAB_PAGE_SIZE - 1));
+}
+
+
+/*
+ * Move up to count chunks of a class into the cache of the calling thread,
+ * taking the class lock once for the whole batch
+ */
+static void slab_refill(int cls, unsigned int count) {
+    slab_class *c = &classes[cls];
+    slab_cache *tc = &tcache[cls];
+
+    pthread_mutex_lock(&c->lock);
+    while (tc->count < count) {
+        void *chunk;
+        if (c->free_list) {
+            chunk = c->free_list;
+            c->free_list = NEXT(chunk);
+            c->free_count--;
+        } else {
+            if (c->next + c->chunk_size > c->end) {
+                char *page = slab_map(SLAB_PAGE_SIZE);
+                if (!page) break;
+                slab_page *hdr = (slab_page *) page;
+                hdr->cls = cls;
+                hdr->size = SLAB_PAGE_SIZE;
+                c->next = page + PAGE_HEADER;
+                c->end = page + SLAB_PAGE_SIZE;
+                c->pages++;
+            }
+            chunk = c->next;
+            c->next += c->chunk_size;
+            c->chunks++;
+        }
+        NEXT(chunk) = tc->head;
+        tc->head = chunk;
+        tc->count++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+/*
+ * Give n chunks of the cache of the calling thread back to the class, so
+ * chunks freed by a thread can be reused by the others
+ */
+static void slab_flush(int cls, unsigned int n) {
+    slab_class *c = &classes[cls];
+    slab_cache *tc = &tcache[cls];
+    if (n > tc->count) n = tc->count;
+    if (n == 0) return;
+
+    void *first = tc->head, *last = first;
+    for (unsigned int i = 1; i < n; i++)
+        last = NEXT(last);
+    tc->head = NEXT(last);
+    tc->count -= n;
+
+    pthread_mutex_lock(&c->lock);
+    NEXT(last) = c->free_list;
+    c->free_list = first;
+    c->free_count += n;
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+static void *slab_alloc_large(size_t size) {
+    size_t len = (PAGE_HEADER + size + 4095) & ~(size_t) 4095;
+    char *page = slab_map(len);
+    if (!page) return NULL;
+
+    slab_page *hdr = (slab_page *) page;
+    hdr->cls = LARGE_CLASS;
+    hdr->size = len;
+    __atomic_add_fetch(&large_pages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&used_bytes, len, __ATOMIC_RELAXED);
+    return page + PAGE_HEADER;
+}
+
+
+/*
+ * Return a chunk of at least size bytes, or NULL when out of memory. The
+ * common case pops the cache of the calling thread without any locking
+ */
+void *slab_alloc(size_t size) {
+    pthread_once(&init_once, slab_init);
+
+    int cls = slab_class_of(size ? size : 1);
+    if (cls < 0) return slab_alloc_large(size);
+
+    slab_cache *tc = &tcache[cls];
+    if (!tc->head) {
+        slab_refill(cls, classes[cls].batch);
+        if (!tc->head) return NULL;
+    }
+
+    void *chunk = tc->head;
+    tc->head = NEXT(chunk);
+    tc->count--;
+    slab_account(classes[cls].chunk_size);
+    return chunk;
+}
+
+
+/*
+ * Release a chunk obtained by slab_alloc, it goes to the cache of the
+ * calling thread, which may not be the one that allocated it
+ */
+void slab_free(void *ptr) {
+    if (!ptr) return;
+
+    slab_page *page = slab_page_of(ptr);
+    if (page->cls == LARGE_CLASS) {
+        __atomic_sub_fetch(&large_pages, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&large_bytes, page->size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&used_bytes, page->size, __ATOMIC_RELAXED);
+        munmap(page, page->size);
+        return;
+    }
+
+    slab_cache *tc = &tcache[page->cls];
+    NEXT(ptr) = tc->head;
+    tc->head = ptr;
+    slab_account(-(long) classes[page->cls].chunk_size);
+    if (++tc->count > 2 * classes[page->cls].batch)
+        slab_flush(page->cls, tc->count / 2);
+}
+
+
+static int slab_addr_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(void * const *) a;
+    uintptr_t y = (uintptr_t) *(void * const *) b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Give back to the system the pages of a class whose chunks are all in its
+ * free list, the surviving free chunks are linked again by page. Must be
+ * called with the class lock held, return the number of pages released
+ */
+static unsigned long slab_trim_class(slab_class *c) {
+    unsigned long n = c->free_count;
+    if (n == 0) return 0;
+
+    void **chunks = malloc(n * sizeof(void *));
+    if (!chunks) return 0;
+
+    void *chunk = c->free_list;
+    for (unsigned long i = 0; i < n; i++, chunk = NEXT(chunk))
+        chunks[i] = chunk;
+    qsort(chunks, n, sizeof(void *), slab_addr_cmp);
+
+    unsigned long full = (SLAB_PAGE_SIZE - PAGE_HEADER) / c->chunk_size;
+    unsigned long released = 0, kept = 0;
+    void *head = NULL;
+
+    for (unsigned long i = 0, j; i < n; i = j) {
+        char *page = (char *) slab_page_of(chunks[i]);
+        for (j = i; j < n && (char *) slab_page_of(chunks[j]) == page; j++)
+            ;
+
+        /* The current page only holds the chunks carved so far */
+        int current = c->end == page + SLAB_PAGE_SIZE;
+        unsigned long carved = current
+            ? (unsigned long) (c->next - page - PAGE_HEADER) / c->chunk_size
+            : full;
+
+        if (j - i == carved) {
+            if (current)
+                c->next = c->end = NULL;
+            munmap(page, SLAB_PAGE_SIZE);
+            c->pages--;
+            c->chunks -= carved;
+            released++;
+            continue;
+        }
+        for (unsigned long k = i; k < j; k++) {
+            NEXT(chunks[k]) = head;
+            head = chunks[k];
+            kept++;
+        }
+    }
+
+    c->free_list = head;
+    c->free_count = kept;
+    free(chunks);
+    return released;
+}
+
+
+/*
+ * Release the slab pages left without any chunk in use, chunks cached by the
+ * calling thread are handed back first while the ones cached by the other
+ * threads keep their page alive. Return the number of bytes released
+ */
+size_t slab_trim(void) {
+    pthread_once(&init_once, slab_init);
+
+    unsigned long pages = 0;
+    for (int i = 0; i < nclasses; i++) {
+        slab_flush(i, tcache[i].count);
+        pthread_mutex_lock(&classes[i].lock);
+        pages += slab_trim_class(&classes[i]);
+        pthread_mutex_unlock(&classes[i].lock);
+    }
+    return pages * SLAB_PAGE_SIZE;
+}
+
+
+/*
+ * Return the number of bytes usable in a chunk, the full size of its class
+ */
+size_t slab_usable_size(void *ptr) {
+    slab_page *page = slab_page_of(ptr);
+    if (page->cls == LARGE_CLASS)
+        return page->size - PAGE_HEADER;
+    return classes[page->cls].chunk_size;
+}
+
+
+/*
+ * Return the bytes taken from the system, slab pages and large allocations
+ */
+size_t slab_memory(void) {
+    pthread_once(&init_once, slab_init);
+
+    size_t total = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+    for (int i = 0; i < nclasses; i++) {
+        pthread_mutex_lock(&classes[i].lock);
+        total += classes[i].pages * SLAB_PAGE_SIZE;
+        pthread_mutex_unlock(&classes[i].lock);
+    }
+    return total;
+}
+
+
+/*
+ * Return the bytes of the chunks in use, chunks cached by the threads are
+ * not counted. The value is approximated by USED_SYNC_BYTES for every thread
+ */
+size_t slab_used(void) {
+    long used = __atomic_load_n(&used_bytes, __ATOMIC_RELAXED);
+    return used > 0 ? used : 0;
+}
+
+
+/*
+ * Fill stats with the usage of up to len classes holding at least a page,
+ * return the number of entries written
+ */
+int slab_stats(slab_class_stats *stats, int len) {
+    pthread_once(&init_once, slab_init);
+
+    int n = 0;
+    for (int i = 0; i < nclasses && n < len; i++) {
+        slab_class *c = &classes[i];
+        pthread_mutex_lock(&c->lock);
+        if (c->pages > 0) {
+            stats[n].chunk_size = c->chunk_size;
+            stats[n].pages = c->pages;
+            stats[n].chunks = c->chunks;
+            stats[n].used = c->chunks - c->free_count;
+            n++;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return n;
+}
+
+
+/*
+ * Return a newly allocated report of the allocator usage, one line for the
+ * totals and one for every class in use. The caller owns the string
+ */
+char *slab_info(void) {
+    slab_class_stats stats[SLAB_MAX_CLASSES];
+    int n = slab_stats(stats, SLAB_MAX_CLASSES);
+    size_t cap = 128 + n * 96, len = 0;
+    char *info = malloc(cap);
+    if (!info) return NULL;
+
+    size_t used = 0, carved = 0;
+    for (int i = 0; i < n; i++) {
+        used += stats[i].used * stats[i].chunk_size;
+        carved += stats[i].pages * (SLAB_PAGE_SIZE - PAGE_HEADER);
+    }
+
+    len += snprintf(info + len, cap - len,
+            "slab_memory:%zu slab_used:%zu slab_utilization:%.2f%% "
+            "large_pages:%lu\n", slab_memory(), used,
+            carved ? 100.0 * used / carved : 0.0,
+            __atomic_load_n(&large_pages, __ATOMIC_RELAXED));
+
+    for (int i = 0; i < n; i++)
+        len += snprintf(info + len, cap - len,
+                "class:%zu pages:%lu chunks:%lu used:%lu\n",
+                stats[i].chunk_size, stats[i].pages,
+                stats[i].chunks, stats[i].used);
+    return info;
+}
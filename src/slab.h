@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+
+#define SLAB_PAGE_SIZE      (1024 * 1024)
+#define SLAB_MIN_CHUNK      16
+#define SLAB_MAX_CHUNK      (SLAB_PAGE_SIZE / 2)
+#define SLAB_GROWTH_FACTOR  1.25
+#define SLAB_MAX_CLASSES    64
+/* Max number of free chunks every thread keeps for a class of small chunks */
+#define SLAB_CACHE_SIZE     64
+
+
+/*
+ * Usage of a size class, chunks held in the free lists of the threads are
+ * counted as used
+ */
+typedef struct {
+    size_t chunk_size;
+    unsigned long pages;
+    unsigned long chunks;
+    unsigned long used;
+} slab_class_stats;
+
+
+/* Slab allocator API */
+void *slab_alloc(size_t);
+void slab_free(void *);
+size_t slab_usable_size(void *);
+size_t slab_memory(void);
+size_t slab_used(void);
+int slab_stats(slab_class_stats *, int);
+char *slab_info(void);
+size_t slab_trim(void);
+
+#endif
@@ -0,0 +1,717 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <strings.h>
+#include "store.h"
+#include "slab.h"
+#include "epoch.h"
+#include "lazyfree.h"
+#include "numa.h"
+#include "util.h"
+
+
+/* Number of active expiry cycles per second */
+static const unsigned int EXPIRE_HZ = 10;
+/* Max time spent by an active expiry cycle, 2.5% of a core at EXPIRE_HZ */
+static const long EXPIRE_CYCLE_US = 2500;
+/* Slots visited under a single hold of a shard lock */
+static const unsigned int EXPIRE_SCAN = 128;
+/* Keys compared to pick every eviction victim */
+#define EVICT_SAMPLES   8
+/* Max keys evicted on behalf of a single write, to bound its latency */
+static const unsigned int EVICT_MAX = 64;
+/* Lock-free attempts of a read racing with writers before taking the lock */
+static const unsigned int READ_ATTEMPTS = 8;
+/* Buckets visited by SCAN under a single hold of a shard lock */
+static const unsigned int SCAN_BATCH = 128;
+/* Buckets visited by a SCAN call for every key asked, bounding empty calls */
+static const unsigned int SCAN_EFFORT = 10;
+
+
+static const char *policy_names[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl"
+};
+
+
+/*
+ * Return a new store with STORE_SHARDS empty shards, or NULL on failure.
+ * Locks prefer writers, a steady stream of GET must not starve SET and DEL
+ */
+store *store_create(void) {
+    store *s = shb_malloc(sizeof(store));
+    if (!s) return NULL;
+
+    s->nshards = STORE_SHARDS;
+    s->expire_shard = 0;
+    s->expiring = 0;
+    s->maxmemory = 0;
+    s->policy = NOEVICTION;
+    s->evicted = 0;
+    s->indexed = 0;
+    s->shards = calloc(s->nshards, sizeof(shard));
+    if (!s->shards) {
+        free(s);
+        return NULL;
+    }
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        pthread_rwlock_init(&s->shards[i].lock, &attr);
+        s->shards[i].map = map_create();
+        /* In NUMA mode shards are spread evenly across the nodes */
+        if (s->shards[i].map && numa_nodes() > 0)
+            s->shards[i].map->node = i % numa_nodes();
+    }
+
+    pthread_rwlockattr_destroy(&attr);
+    return s;
+}
+
+
+/*
+ * Deallocate the store and every map it contains
+ */
+void store_release(store *s) {
+    if (!s) return;
+    if (s->expiring) {
+        __atomic_store_n(&s->expiring, 0, __ATOMIC_RELEASE);
+        pthread_join(s->expire_thread, NULL);
+    }
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        map_release(s->shards[i].map);
+        pthread_rwlock_destroy(&s->shards[i].lock);
+    }
+    free(s->shards);
+    free(s);
+}
+
+
+/*
+ * Return the shard responsible for a key given its hash, the shard bits are
+ * taken far from the low ones indexing the map slots
+ */
+shard *store_shard(store *s, unsigned long hash) {
+    return &s->shards[(hash >> 48) % s->nshards];
+}
+
+
+/*
+ * Set a key to a value, both are copied into the store. The hash of the key
+ * comes from the request and serves both the shard and the slot lookup
+ */
+int store_put(store *s, const char *key, unsigned long hash, const char *val) {
+    shard *sh = store_shard(s, hash);
+    SHARD_WRLOCK(sh);
+    int ret = map_put_hashed(sh->map, key, hash, val);
+    SHARD_UNLOCK(sh);
+    return ret;
+}
+
+
+/*
+ * Set key to val only if its version is still the given one, 0 meaning the
+ * key must not exist. Return MAP_MISMATCH if it was written in the meantime
+ */
+int store_cas(store *s, const char *key, unsigned long hash,
+        uint64_t version, const char *val) {
+    shard *sh = store_shard(s, hash);
+    SHARD_WRLOCK(sh);
+    int ret = map_cas_hashed(sh->map, key, hash, version, val);
+    SHARD_UNLOCK(sh);
+    return ret;
+}
+
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
+/*
+ * Return a copy of the value associated to key or NULL if not found, the copy
+ * stays valid after concurrent writes and must be freed by the caller. Reads
+ * take no lock: the value is copied while pinning an epoch, so writers never
+ * free it under our feet, and the copy is thrown away if a writer went
+ * through the shard meanwhile. Only a read losing the race several times in
+ * a row waits for the writers on the shard lock
+ */
+char *store_get(store *s, const char *key, unsigned long hash) {
+    char *val = NULL;
+    int ret = MAP_RETRY;
+    shard *sh = store_shard(s, hash);
+
+    if (epoch_enter() == 0) {
+        for (unsigned int i = 0; i < READ_ATTEMPTS && ret == MAP_RETRY; i++) {
+            unsigned long seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                cpu_relax();
+                continue;
+            }
+            ret = map_read_hashed(__atomic_load_n(&sh->map, __ATOMIC_RELAXED),
+                    key, hash, &sh->seq, seq, &val);
+        }
+        epoch_exit();
+    }
+
+    if (ret == MAP_RETRY) {
+        ret = MAP_ERR;
+        SHARD_RDLOCK(sh);
+        map_entry *e = map_lookup_hashed(sh->map, key, hash);
+        if (e && map_entry_expired(sh->map, e)) {
+            ret = MAP_EXPIRED;
+        } else if (e) {
+            val = map_entry_value(e);
+            ret = MAP_OK;
+        }
+        SHARD_UNLOCK(sh);
+    }
+
+    /* Lazy expiry, the key may have been set again meanwhile */
+    if (ret == MAP_EXPIRED) {
+        SHARD_WRLOCK(sh);
+        map_expire_hashed(sh->map, key, hash);
+        SHARD_UNLOCK(sh);
+    }
+    return val;
+}
+
+
+/*
+ * Add by to the integer value of a key. Keys already holding an integer are
+ * updated in place under the shared lock, so increments of different keys of
+ * a shard never wait for each other, only the first increment of a value
+ * stored as text takes the write lock to convert it. Return MAP_ERR if the
+ * key is missing or its value is not an integer
+ */
+int store_incr(store *s, const char *key, unsigned long hash, int64_t by) {
+    shard *sh = store_shard(s, hash);
+    SHARD_RDLOCK(sh);
+    int ret = map_incr_hashed(sh->map, key, hash, by);
+    SHARD_UNLOCK(sh);
+
+    if (ret == MAP_RETRY) {
+        SHARD_WRLOCK(sh);
+        ret = map_encode_hashed(sh->map, key, hash, VAL_INT);
+        if (ret == MAP_OK)
+            ret = map_incr_hashed(sh->map, key, hash, by);
+        SHARD_UNLOCK(sh);
+    }
+    return ret;
+}
+
+
+/*
+ * Add by to the value of a key as a double, like store_incr. Integers and
+ * text holding a number are converted on the first call
+ */
+int store_incrf(store *s, const char *key, unsigned long hash, double by) {
+    shard *sh = store_shard(s, hash);
+    SHARD_RDLOCK(sh);
+    int ret = map_incrf_hashed(sh->map, key, hash, by);
+    SHARD_UNLOCK(sh);
+
+    if (ret == MAP_RETRY) {
+        SHARD_WRLOCK(sh);
+        ret = map_encode_hashed(sh->map, key, hash, VAL_DOUBLE);
+        if (ret == MAP_OK)
+            ret = map_incrf_hashed(sh->map, key, hash, by);
+        SHARD_UNLOCK(sh);
+    }
+    return ret;
+}
+
+
+/*
+ * Remove a key from the store
+ */
+int store_del(store *s, const char *key, unsigned long hash) {
+    shard *sh = store_shard(s, hash);
+    SHARD_WRLOCK(sh);
+    int ret = map_del_hashed(sh->map, key, hash);
+    SHARD_UNLOCK(sh);
+    return ret;
+}
+
+
+static void release_map(void *m) {
+    map_release(m);
+}
+
+
+/* Once no reader can see it anymore, a map is released in the background */
+static void retire_map(void *m) {
+    lazyfree_submit(m, release_map);
+}
+
+
+/*
+ * Empty every shard of the store, one at a time. Every shard gets a fresh
+ * map, the old ones are released by the lazyfree threads so that the caller
+ * returns right away however many keys they hold. The fresh maps are all
+ * allocated first, return STORE_OOM leaving every key in place if they
+ * can't be
+ */
+int store_flush(store *s) {
+    map **fresh = calloc(s->nshards, sizeof(map *));
+    if (!fresh) return STORE_OOM;
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        fresh[i] = map_create();
+        if (!fresh[i] || (s->indexed && map_index(fresh[i]) != MAP_OK)) {
+            for (unsigned int j = 0; j <= i; j++)
+                if (fresh[j]) map_release(fresh[j]);
+            free(fresh);
+            return STORE_OOM;
+        }
+    }
+
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        shard *sh = &s->shards[i];
+        SHARD_WRLOCK(sh);
+        map *old = sh->map, *m = fresh[i];
+        /* Versions go on from the old map, a CAS can't match a flushed key */
+        m->version = old->version;
+        m->node = old->node;
+        __atomic_store_n(&sh->map, m, __ATOMIC_RELEASE);
+        SHARD_UNLOCK(sh);
+        /* Lock-free readers may still be probing the old map */
+        epoch_retire(old, retire_map);
+    }
+    free(fresh);
+    /* Hand the old maps over now instead of at the next retirements */
+    epoch_reclaim();
+    return MAP_OK;
+}
+
+
+/*
+ * Return the total number of keys, shards are read one by one so the result
+ * is not a snapshot under concurrent writes
+ */
+unsigned long store_size(store *s) {
+    unsigned long size = 0;
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        SHARD_RDLOCK(&s->shards[i]);
+        size += s->shards[i].map->size;
+        SHARD_UNLOCK(&s->shards[i]);
+    }
+    return size;
+}
+
+
+/*
+ * Shrink the table of every shard to fit its keys, one shard at a time, then
+ * give the slab pages left empty back to the system. Return the number of
+ * bytes released
+ */
+size_t store_compact(store *s) {
+    size_t before = map_tables_memory();
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        SHARD_WRLOCK(&s->shards[i]);
+        map_compact(s->shards[i].map);
+        SHARD_UNLOCK(&s->shards[i]);
+    }
+    size_t after = map_tables_memory();
+    return (before > after ? before - after : 0) + slab_trim();
+}
+
+
+/*
+ * Enable or disable the ordered index of the keys of every shard, existing
+ * keys are indexed right away. Return MAP_ERR if an index couldn't be built
+ */
+int store_index(store *s, int enabled) {
+    int ret = MAP_OK;
+    for (unsigned int i = 0; i < s->nshards; i++) {
+        SHARD_WRLOCK(&s->shards[i]);
+        if (!enabled)
+            map_unindex(s->shards[i].map);
+        else if (map_index(s->shards[i].map) == MAP_ERR)
+            ret = MAP_ERR;
+        SHARD_UNLOCK(&s->shards[i]);
+    }
+    s->indexed = enabled && ret == MAP_OK;
+    return ret;
+}
+
+
+static int key_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/*
+ * Append a copy of key to a growing array of keys, return 0 if it couldn't
+ * be grown
+ */
+static int keys_append(char ***keys, unsigned long *n,
+        unsigned long *cap, const char *key) {
+    if (*n == *cap) {
+        char **grown = realloc(*keys, (*cap ? *cap * 2 : 64) * sizeof(char *));
+        if (!grown) return 0;
+        *keys = grown;
+        *cap = *cap ? *cap * 2 : 64;
+    }
+    (*keys)[(*n)++] = strdup(key);
+    return 1;
+}
+
+
+/*
+ * Append to keys the live keys of a shard from its index, starting from the
+ * first one not lower than from, up to limit of them (0 for no limit)
+ */
+static void shard_keys(shard *sh, const char *from, const char *to,
+        const char *prefix, unsigned long limit, char ***keys,
+        unsigned long *n, unsigned long *cap) {
+    size_t tolen = to ? strlen(to) : 0, plen = prefix ? strlen(prefix) : 0;
+    unsigned long found = 0;
+
+    SHARD_RDLOCK(sh);
+    map *m = sh->map;
+    if (m->index) {
+        skiplist_node *node = skiplist_seek(m->index, from, strlen(from));
+        for (; node && (limit == 0 || found < limit); node = node->next[0]) {
+            const char *key = skiplist_key(node);
+            if (to && skiplist_compare(node, to, tolen) > 0)
+                break;
+            if (prefix && (node->klen < plen || memcmp(key, prefix, plen) != 0))
+                break;
+            if (m->expires > 0 && !map_live_hashed(m, key, node->hash))
+                continue;
+            if (!keys_append(keys, n, cap, key))
+                break;
+            found++;
+        }
+    }
+    SHARD_UNLOCK(sh);
+}
+
+
+/*
+ * Return the keys of the store in lexicographic order, starting from from
+ * and up to to included if not NULL, that begin with prefix if not NULL.
+ * Every shard is walked from a seek in its index, and at most limit keys are
+ * returned (0 for no limit). The number of keys is stored in count, the
+ * caller owns the array and its strings
+ */
+char **store_keys(store *s, const char *from, const char *to,
+        const char *prefix, unsigned long limit, unsigned long *count) {
+    char **keys = NULL;
+    unsigned long n = 0, cap = 0;
+
+    for (unsigned int i = 0; i < s->nshards; i++)
+        shard_keys(&s->shards[i], from, to, prefix, limit, &keys, &n, &cap);
+
+    if (n > 0)
+        qsort(keys, n, sizeof(char *), key_cmp);
+    if (limit > 0 && n > limit) {
+        for (unsigned long i = limit; i < n; i++)
+            free(keys[i]);
+        n = limit;
+    }
+    *count = n;
+    return keys;
+}
+
+
+struct scan_state {
+    const char *pattern;
+    char **keys;
+    unsigned long n;
+    unsigned long cap;
+};
+
+
+static int scan_collect(void *arg, void *data) {
+    struct scan_state *st = arg;
+    map_entry *e = data;
+    if (!st->pattern || glob_match(st->pattern, e->key))
+        keys_append(&st->keys, &st->n, &st->cap, e->key);
+    return MAP_OK;
+}
+
+
+/*
+ * Walk the keyspace a few buckets at a time. The cursor holds the shard in
+ * its low bits and the position of the map scan of that shard in the others,
+ * so no state is kept between calls, 0 starts a new scan. Buckets are
+ * visited until count keys are collected or count * SCAN_EFFORT buckets
+ * have been visited, and a shard lock is never held for more than SCAN_BATCH
+ * of them. Keys matching pattern, if not NULL, are stored in keys and their
+ * number in found, the caller owns the array and its strings. Return the
+ * cursor to resume from, 0 once every shard has been walked
+ */
+unsigned long store_scan(store *s, unsigned long cursor, const char *pattern,
+        unsigned long count, char ***keys, unsigned long *found) {
+    struct scan_state st = { pattern, NULL, 0, 0 };
+    unsigned long shard_idx = cursor % s->nshards, pos = cursor / s->nshards;
+    unsigned long budget = count * SCAN_EFFORT;
+    if (budget / SCAN_EFFORT != count) budget = ULONG_MAX;
+
+    while (shard_idx < s->nshards && budget > 0 && st.n < count) {
+        shard *sh = &s->shards[shard_idx];
+        SHARD_RDLOCK(sh);
+        if (sh->map->size == 0) {
+            pos = 0;
+        } else {
+            for (unsigned int i = 0; i < SCAN_BATCH && budget > 0
+                    && st.n < count; i++, budget--) {
+                pos = map_scan(sh->map, pos, scan_collect, &st);
+                if (pos == 0) break;
+            }
+        }
+        SHARD_UNLOCK(sh);
+        if (pos == 0) shard_idx++;
+    }
+
+    *keys = st.keys;
+    *found = st.n;
+    return shard_idx == s->nshards ? 0 : pos * s->nshards + shard_idx;
+}
+
+
+static long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+/*
+ * Tell without the lock if an expiry pass has anything to do on a shard, that
+ * is keys with a TTL or a resize still to drain. A stale answer only delays
+ * the work to the next cycle, while skipping idle shards spares their seqlock
+ * bumps and the retries of the optimistic readers
+ */
+static int shard_needs_expiry(shard *sh) {
+    /* A flush may retire the map under us, when in doubt do the pass */
+    if (epoch_enter() != 0)
+        return 1;
+    map *m = __atomic_load_n(&sh->map, __ATOMIC_ACQUIRE);
+    int busy = __atomic_load_n(&m->expires, __ATOMIC_RELAXED) > 0
+        || __atomic_load_n(&m->old_entries, __ATOMIC_RELAXED) != NULL;
+    epoch_exit();
+    return busy;
+}
+
+
+/*
+ * Run an active expiry cycle: shards are visited round robin, EXPIRE_SCAN
+ * slots at a time under their write lock so that no request waits long.
+ * Rounds go on while more than a quarter of the sampled keys with a TTL were
+ * expired, and the cycle always stops once budget_us microseconds are spent.
+ * Return the number of reclaimed keys
+ */
+unsigned long store_expire_cycle(store *s, long budget_us) {
+    unsigned long total = 0, expired, sampled;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do {
+        expired = sampled = 0;
+        for (unsigned int i = 0; i < s->nshards; i++) {
+            shard *sh = &s->shards[s->expire_shard];
+            s->expire_shard = (s->expire_shard + 1) % s->nshards;
+            if (!shard_needs_expiry(sh))
+                continue;
+            SHARD_WRLOCK(sh);
+            expired += map_expire_scan(sh->map,
+                    &sh->expire_cursor, EXPIRE_SCAN, &sampled);
+            /* Let resizes of idle shards complete without any write */
+            map_rehash_step(sh->map, EXPIRE_SCAN);
+            SHARD_UNLOCK(sh);
+            if (elapsed_us(&start) >= budget_us)
+                return total + expired;
+        }
+        total += expired;
+    } while (sampled > 0 && expired * 4 > sampled);
+
+    return total;
+}
+
+
+static void *expire_loop(void *arg) {
+    store *s = (store *) arg;
+    struct timespec tick = { 0, 1000000000L / EXPIRE_HZ };
+
+    while (__atomic_load_n(&s->expiring, __ATOMIC_ACQUIRE)) {
+        map_clock_tick();
+        store_expire_cycle(s, EXPIRE_CYCLE_US);
+        epoch_reclaim();
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+
+/*
+ * Start the background thread running the active expiry cycles
+ */
+int store_start_expiry(store *s) {
+    s->expiring = 1;
+    if (pthread_create(&s->expire_thread, NULL, expire_loop, s) != 0) {
+        s->expiring = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Return the memory used by the keyspace of the node, keys and values plus
+ * the tables of the maps
+ */
+size_t store_memory(void) {
+    return slab_used() + map_tables_memory();
+}
+
+
+/*
+ * Tell if candidate is a better eviction victim than best
+ */
+static int evict_better(map *m, evict_policy policy,
+        map_entry *candidate, map_entry *best) {
+    switch (policy) {
+        case ALLKEYS_LRU:
+            return map_entry_idle(candidate) > map_entry_idle(best);
+        case ALLKEYS_LFU: {
+            unsigned int cf = map_entry_freq(candidate), bf = map_entry_freq(best);
+            return cf < bf || (cf == bf
+                    && map_entry_idle(candidate) > map_entry_idle(best));
+        }
+        case VOLATILE_TTL:
+            return map_entry_meta(m, candidate)->expire_time
+                < map_entry_meta(m, best)->expire_time;
+        default:
+            return 0;
+    }
+}
+
+
+/*
+ * Evict a single key: a random shard is sampled and the best victim among the
+ * sampled keys according to the policy is removed. Return MAP_ERR if the
+ * shard had no candidate
+ */
+static int store_evict(store *s, unsigned int *seed) {
+    shard *sh = &s->shards[rand_r(seed) % s->nshards];
+    map_entry *sample[EVICT_SAMPLES];
+    int ret = MAP_ERR;
+
+    SHARD_WRLOCK(sh);
+    map *m = sh->map;
+    unsigned long total = m->table_size + m->old_table_size;
+    unsigned long start = ((unsigned long) rand_r(seed) << 16 ^ rand_r(seed)) % total;
+    unsigned int n = map_sample(m, start, s->policy == VOLATILE_TTL,
+            sample, EVICT_SAMPLES);
+    if (n > 0) {
+        map_entry *best = sample[0];
+        for (unsigned int i = 1; i < n; i++)
+            if (evict_better(m, s->policy, sample[i], best))
+                best = sample[i];
+        /* Copy what's needed, deleting may move entries around */
+        const char *key = best->key;
+        unsigned long hash = best->hash;
+        map_del_hashed(m, key, hash);
+        __atomic_add_fetch(&s->evicted, 1, __ATOMIC_RELAXED);
+        ret = MAP_OK;
+    }
+    SHARD_UNLOCK(sh);
+    /* Memory counts as freed only once reclaimed */
+    epoch_reclaim();
+    return ret;
+}
+
+
+/*
+ * Make sure a write can proceed under the memory limit, evicting keys if the
+ * policy allows it. Must be called before locking the shard of the write, as
+ * victims are taken from any shard. Return STORE_OOM if the write must be
+ * refused
+ */
+int store_make_room(store *s) {
+    if (s->maxmemory == 0 || store_memory() <= s->maxmemory)
+        return MAP_OK;
+    if (s->policy == NOEVICTION)
+        return STORE_OOM;
+
+    static __thread unsigned int seed;
+    if (!seed) seed = (uintptr_t) &seed;
+
+    unsigned int evicted = 0, misses = 0;
+    while (store_memory() > s->maxmemory && evicted < EVICT_MAX) {
+        if (store_evict(s, &seed) == MAP_OK) {
+            evicted++;
+        } else if (++misses >= s->nshards) {
+            /* Nothing left that the policy allows to evict */
+            return STORE_OOM;
+        }
+    }
+    return MAP_OK;
+}
+
+
+/*
+ * Return the policy matching a name, or -1 if there's none
+ */
+int store_policy(const char *name) {
+    for (unsigned int i = 0; i < sizeof(policy_names) / sizeof(char *); i++)
+        if (strcasecmp(name, policy_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+
+const char *store_policy_name(evict_policy policy) {
+    return policy_names[policy];
+}
+
+
+/*
+ * Return a newly allocated report of the memory used by the store, followed
+ * by the allocator usage. The caller owns the string
+ */
+char *store_info(store *s) {
+    char head[256];
+    snprintf(head, sizeof(head),
+            "used_memory:%zu maxmemory:%zu maxmemory_policy:%s evicted_keys:%lu"
+            " lazyfree_pending:%lu\n",
+            store_memory(), s->maxmemory, store_policy_name(s->policy),
+            __atomic_load_n(&s->evicted, __ATOMIC_RELAXED), lazyfree_pending());
+    char *slab = slab_info();
+    if (!slab) return NULL;
+    char *info = append_string(head, slab);
+    free(slab);
+    return info;
+}
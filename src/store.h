@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <pthread.h>
+#include "map.h"
+
+
+#define STORE_SHARDS    64
+
+/* Returned by writes refused because the memory limit was reached */
+#define STORE_OOM       -3
+
+
+/*
+ * What to do when the memory limit is reached, approximated by sampling a few
+ * keys for every eviction
+ */
+typedef enum {
+    NOEVICTION,         // refuse writes that need more memory
+    ALLKEYS_LRU,        // evict the least recently used keys
+    ALLKEYS_LFU,        // evict the least frequently used keys
+    VOLATILE_TTL        // evict the keys with a TTL closest to expire
+} evict_policy;
+
+
+/*
+ * A shard is an independent slice of the keyspace, a map guarded by its own
+ * reader/writer lock, keys are assigned to a shard by their hash. Writers
+ * keep seq odd while they hold the lock, so that GET can read the map without
+ * locking and tell when its view may have been torn
+ */
+typedef struct {
+    pthread_rwlock_t lock;
+    unsigned long seq;
+    map *map;
+    unsigned long expire_cursor;
+} shard;
+
+
+/*
+ * The store is the whole keyspace of the node, split in a fixed number of
+ * shards so that workers touching different keys rarely contend. Keys with a
+ * TTL are reclaimed in the background by an expire thread that walks the
+ * shards starting from expire_shard. Writes can be bounded to maxmemory bytes,
+ * keys are then evicted according to policy, 0 means no limit. If indexed is
+ * set every shard also keeps its keys in order for range queries
+ */
+typedef struct {
+    unsigned int nshards;
+    shard *shards;
+    unsigned int expire_shard;
+    int expiring;
+    pthread_t expire_thread;
+    size_t maxmemory;
+    evict_policy policy;
+    unsigned long evicted;
+    int indexed;
+} store;
+
+
+static inline void shard_write_begin(shard *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    /* Readers seeing any of the following writes must see seq odd too */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/* Only a writer can find seq odd, readers holding the lock leave it alone */
+static inline void shard_write_end(shard *s) {
+    if (s->seq & 1)
+        __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+#define SHARD_RDLOCK(s) pthread_rwlock_rdlock(&(s)->lock)
+#define SHARD_WRLOCK(s) do {                \
+    pthread_rwlock_wrlock(&(s)->lock);      \
+    shard_write_begin(s);                   \
+} while (0)
+#define SHARD_UNLOCK(s) do {                \
+    shard_write_end(s);                     \
+    pthread_rwlock_unlock(&(s)->lock);      \
+} while (0)
+
+
+/* Store API */
+store *store_create(void);
+void store_release(store *);
+shard *store_shard(store *, unsigned long);
+int store_put(store *, const char *, unsigned long, const char *);
+int store_cas(store *, const char *, unsigned long, uint64_t, const char *);
+char *store_get(store *, const char *, unsigned long);
+int store_incr(store *, const char *, unsigned long, int64_t);
+int store_incrf(store *, const char *, unsigned long, double);
+int store_del(store *, const char *, unsigned long);
+int store_flush(store *);
+unsigned long store_size(store *);
+size_t store_compact(store *);
+int store_index(store *, int);
+unsigned long store_scan(store *, unsigned long, const char *,
+        unsigned long, char ***, unsigned long *);
+char **store_keys(store *, const char *, const char *,
+        const char *, unsigned long, unsigned long *);
+unsigned long store_expire_cycle(store *, long);
+int store_start_expiry(store *);
+size_t store_memory(void);
+int store_make_room(store *);
+int store_policy(const char *);
+const char *store_policy_name(evict_policy);
+char *store_info(store *);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+/* Group of the provided buffers, every ring has a single one */
+#define URING_BGID          0
+
+
+static int uring_enter(uring *r, unsigned int wait) {
+    /* Publish the entries queued since the last call */
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    unsigned int pending = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        int n = syscall(__NR_io_uring_enter, r->fd, pending, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0 || errno != EINTR)
+            return n;
+    }
+}
+
+
+/*
+ * Create the rings, trying first the flags that let the kernel run the
+ * completion work only when the owner thread waits for it
+ */
+static int uring_setup(struct io_uring_params *p) {
+    unsigned int flags[] = {
+#ifdef IORING_SETUP_DEFER_TASKRUN
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+        IORING_SETUP_COOP_TASKRUN,
+#endif
+        0
+    };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        memset(p, 0, sizeof(*p));
+        p->flags = flags[i] | IORING_SETUP_CQSIZE;
+        p->cq_entries = URING_ENTRIES * 4;
+        int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, p);
+        if (fd >= 0 || errno != EINVAL)
+            return fd;
+    }
+    return -1;
+}
+
+
+static void uring_provide(uring *r, unsigned int bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t) (uintptr_t) (r->bufs + (size_t) bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    r->br_tail++;
+}
+
+
+/*
+ * Setup a ring and its provided buffers, to be used by the calling thread
+ * only. Return -1 if io_uring or one of the features needed is missing
+ */
+int uring_init(uring *r) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+#ifndef IORING_RECV_MULTISHOT
+    errno = ENOSYS;
+    return -1;
+#else
+    struct io_uring_params p;
+    if ((r->fd = uring_setup(&p)) < 0)
+        return -1;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len)
+            r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = 0;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto err;
+    }
+    r->cq_ring = r->sq_ring;
+    if (r->cq_ring_len) {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto err;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto err;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    /* Entries are always used in order, slot i of the array points to i */
+    unsigned int *array = (unsigned int *) (sq + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* The ring of provided buffers must be page aligned */
+    r->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        goto err;
+    }
+    if (!(r->bufs = malloc((size_t) URING_BUFS * URING_BUF_SIZE)))
+        goto err;
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) r->br,
+        .ring_entries = URING_BUFS,
+        .bgid = URING_BGID
+    };
+    if (syscall(__NR_io_uring_register, r->fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto err;
+    for (unsigned int i = 0; i < URING_BUFS; i++)
+        uring_provide(r, i);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    return 0;
+
+err:
+    uring_release(r);
+    return -1;
+#endif
+}
+
+
+void uring_release(uring *r) {
+    if (r->fd >= 0) close(r->fd);
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_len);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_len);
+    if (r->br) munmap(r->br, r->br_len);
+    free(r->bufs);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+
+/*
+ * Hand all the queued entries to the kernel with a single call and wait for
+ * at least a completion. Return -1 on error
+ */
+int uring_wait(uring *r) {
+    return uring_enter(r, 1) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Return the next completion without consuming it, or NULL if there's none
+ */
+struct io_uring_cqe *uring_cqe(uring *r) {
+    unsigned int head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+
+void uring_cqe_seen(uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return the provided buffer holding the data of a receive completion, or
+ * NULL if it carries none
+ */
+char *uring_buffer(uring *r, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return NULL;
+    return r->bufs + (size_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE;
+}
+
+
+/*
+ * Give the buffer of a receive completion back to the kernel
+ */
+void uring_recycle(uring *r, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return;
+    uring_provide(r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return a free submission entry, handing the queued ones to the kernel if
+ * the ring is full, or NULL if none could be freed
+ */
+static struct io_uring_sqe *uring_sqe(uring *r) {
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (uring_enter(r, 0) < 0 || r->sq_local
+                - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+
+#ifdef IORING_RECV_MULTISHOT
+
+/*
+ * Accept connections on a listening socket until cancelled, every one is
+ * reported by a completion of its own
+ */
+int uring_accept(uring *r, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+
+/*
+ * Receive from a socket until it's closed or the provided buffers run out,
+ * every completion carries the data in one of them
+ */
+int uring_recv(uring *r, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+#else
+
+int uring_accept(uring *r, int fd, uint64_t data) {
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int uring_recv(uring *r, int fd, uint64_t data) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+
+/*
+ * Send a message gathered from many buffers, which must stay untouched
+ * until its completion
+ */
+int uring_sendmsg(uring *r, int fd, struct msghdr *msg, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = data;
+    return 0;
+}
+
+
+int uring_read(uring *r, int fd, void *buf, unsigned int len, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->user_data = data;
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016-2017 Andrea Giacomo Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+
+/* Submission queue entries of a ring, completions get four times as many */
+#define URING_ENTRIES       1024
+/* Receive buffers handed to the kernel by a ring, a power of 2 */
+#define URING_BUFS          256
+#define URING_BUF_SIZE      (8 * 1024)
+
+
+/*
+ * An io_uring instance driven with raw syscalls, so no library is needed.
+ * Entries are queued on the submission ring and handed to the kernel all at
+ * once by uring_wait, which also waits for completions. Received data lands
+ * in buffers taken by the kernel from a ring of provided buffers, each one
+ * must be given back with uring_recycle once consumed. uring_init fails if
+ * the kernel lacks multishot accept and receive or provided buffer rings
+ */
+typedef struct {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    uint16_t br_tail;
+} uring;
+
+
+/* io_uring API */
+int uring_init(uring *);
+void uring_release(uring *);
+int uring_wait(uring *);
+struct io_uring_cqe *uring_cqe(uring *);
+void uring_cqe_seen(uring *);
+char *uring_buffer(uring *, const struct io_uring_cqe *);
+void uring_recycle(uring *, const struct io_uring_cqe *);
+int uring_accept(uring *, int, uint64_t);
+int uring_recv(uring *, int, uint64_t);
+int uring_sendmsg(uring *, int, struct msghdr *, uint64_t);
+int uring_read(uring *, int, void *, unsigned int, uint64_t);
+
+#endif
@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -227,6 +229,113 @@ double to_double(const char *s) {
 }
 
 
+/*
+ * auxiliary function to parse a whole string, trailing spaces aside, into a
+ * 64 bit integer, return 0 if it's not a valid one or out of range
+ */
+int parse_int64(const char *s, int64_t *num) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || errno == ERANGE) return 0;
+    while (isspace(*end)) end++;
+    if (*end != '\0') return 0;
+    *num = n;
+    return 1;
+}
+
+
+/*
+ * auxiliary function to parse a whole string, trailing spaces aside, into a
+ * finite double, return 0 if it's not a valid one
+ */
+int parse_double(const char *s, double *num) {
+    char *end;
+    errno = 0;
+    double d = strtod(s, &end);
+    if (end == s || errno == ERANGE || !isfinite(d)) return 0;
+    while (isspace(*end)) end++;
+    if (*end != '\0') return 0;
+    *num = d;
+    return 1;
+}
+
+
+/*
+ * Match a class like [a-z0-9] or [^abc] starting right after its opening
+ * bracket against c, storing in end the first character past the class.
+ * An unterminated class matches a literal '['
+ */
+static int class_match(const char *p, char c, const char **end) {
+    const char *start = p;
+    int negate = *p == '^' || *p == '!', match = 0;
+    if (negate) p++;
+    for (; *p && *p != ']'; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            if (*p == c) match = 1;
+        } else if (p[1] == '-' && p[2] && p[2] != ']') {
+            char lo = p[0] < p[2] ? p[0] : p[2], hi = p[0] < p[2] ? p[2] : p[0];
+            if (c >= lo && c <= hi) match = 1;
+            p += 2;
+        } else if (*p == c) {
+            match = 1;
+        }
+    }
+    if (*p != ']') {
+        *end = start;
+        return c == '[';
+    }
+    *end = p + 1;
+    return negate ? !match : match;
+}
+
+
+/*
+ * Match a string against a glob pattern supporting *, ?, character classes
+ * and backslash escapes. A star is retried from the last one seen only, so
+ * matching never goes exponential
+ */
+int glob_match(const char *pattern, const char *str) {
+    const char *p = pattern, *s = str, *star = NULL, *retry = NULL, *next;
+
+    while (*s) {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            if (!*p) return 1;
+            star = p;
+            retry = s;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            if (class_match(p + 1, *s, &next)) {
+                p = next;
+                s++;
+                continue;
+            }
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            if (*p && *p == *s) {
+                p++;
+                s++;
+                continue;
+            }
+        }
+        if (!star) return 0;
+        p = star;
+        s = ++retry;
+    }
+
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+
 /*
  * Define the current node name inside the cluster
  */
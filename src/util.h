@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 
 
@@ -46,6 +47,9 @@ int is_integer(const char *);
 int is_float(const char *);
 int to_int(const char *);
 double to_double(const char *);
+int parse_int64(const char *, int64_t *);
+int parse_double(const char *, double *);
+int glob_match(const char *, const char *);
 const char *node_name(unsigned int);
 const char *get_homedir(void);
 char *append_string(const char *, const char *);
@@ -1,9 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "unit.h"
 #include "../src/map.h"
+#include "../src/store.h"
+#include "../src/slab.h"
+#include "../src/epoch.h"
+#include "../src/skiplist.h"
+#include "../src/lazyfree.h"
+#include "../src/numa.h"
+#include "../src/session.h"
+#include "../src/uring.h"
+#include "../src/commands.h"
 #include "../src/list.h"
+#include "../src/hashing.h"
+#include "../src/util.h"
+
+
+#define KEY_HASH(k) key_hash((k), strlen(k))
 
 
 int tests_run = 0;
@@ -38,11 +54,11 @@ static char *test_map_put(void) {
     map *m = map_create();
     char *key = "hello";
     char *val = "world";
-    int status = map_put(m, strdup(key), strdup(val));
+    int status = map_put(m, key, val);
     ASSERT("[! put]: map size = 0", m->size == 1);
     ASSERT("[! put]: put didn't work as expected", status == MAP_OK);
     char *val1 = "WORLD";
-    map_put(m, strdup(key), strdup(val1));
+    map_put(m, key, val1);
     void *ret = map_get(m, key);
     ASSERT("[! put]: put didn't update the value", strcmp(val1, ret) == 0);
     map_release(m);
@@ -57,7 +73,7 @@ static char *test_map_get(void) {
     map *m = map_create();
     char *key = "hello";
     char *val = "world";
-    map_put(m, strdup(key), strdup(val));
+    map_put(m, key, val);
     char *ret = (char *) map_get(m, key);
     ASSERT("[! get]: get didn't work as expected", strcmp(ret, val) == 0);
     map_release(m);
@@ -72,7 +88,7 @@ static char *test_map_del(void) {
     map *m = map_create();
     char *key = "hello";
     char *val = "world";
-    map_put(m, strdup(key), strdup(val));
+    map_put(m, key, val);
     int status = map_del(m, key);
     ASSERT("[! del]: map size = 1", m->size == 0);
     ASSERT("[! del]: del didn't work as expected", status == MAP_OK);
@@ -81,6 +97,221 @@ static char *test_map_del(void) {
 }
 
 
+/*
+ * Tests updates moving a value between embedded and spilled storage
+ */
+static char *test_map_embedded(void) {
+    map *m = map_create();
+    char large[EMBED_VAL_MAX * 2];
+    memset(large, 'x', sizeof(large) - 1);
+    large[sizeof(large) - 1] = '\0';
+    map_put(m, "hello", "world");
+    ASSERT("[! embedded]: short value not embedded",
+            map_get_entry(m, "hello")->embedded == 1);
+    map_put(m, "hello", large);
+    ASSERT("[! embedded]: long value not spilled",
+            map_get_entry(m, "hello")->embedded == 0);
+    ASSERT("[! embedded]: long value not updated",
+            strcmp(map_get(m, "hello"), large) == 0);
+    map_put(m, "hello", "again");
+    ASSERT("[! embedded]: short value not embedded again",
+            map_get_entry(m, "hello")->embedded == 1);
+    ASSERT("[! embedded]: short value not updated",
+            strcmp(map_get(m, "hello"), "again") == 0);
+    ASSERT("[! embedded]: key altered",
+            strcmp(map_get_entry(m, "hello")->key, "hello") == 0);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests that keys stay reachable while the map grows incrementally
+ */
+static char *test_map_rehash(void) {
+    map *m = map_create();
+    char key[16];
+    int rehashing = 0;
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        map_put(m, key, key);
+        if (m->old_entries) rehashing = 1;
+    }
+    ASSERT("[! rehash]: rehash never started", rehashing == 1);
+    ASSERT("[! rehash]: map size != 10000", m->size == 10000);
+    for (int i = 0; i < 10000; i += 2) {
+        snprintf(key, 16, "key:%d", i);
+        ASSERT("[! rehash]: del didn't work as expected", map_del(m, key) == MAP_OK);
+    }
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        char *val = map_get(m, key);
+        if (i % 2 == 0)
+            ASSERT("[! rehash]: deleted key found", val == NULL);
+        else
+            ASSERT("[! rehash]: key lost during rehash",
+                    val && strcmp(val, key) == 0);
+    }
+    ASSERT("[! rehash]: map size != 5000", m->size == 5000);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests that a churn of inserts and deletes doesn't grow the table
+ */
+static char *test_map_churn(void) {
+    map *m = map_create();
+    unsigned long table_size = m->table_size;
+    char key[16];
+    for (int i = 0; i < 100000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        map_put(m, key, key);
+        if (i >= 64) {
+            snprintf(key, 16, "key:%d", i - 64);
+            ASSERT("[! churn]: del didn't work as expected", map_del(m, key) == MAP_OK);
+        }
+    }
+    ASSERT("[! churn]: map size != 64", m->size == 64);
+    ASSERT("[! churn]: table grew with deletes", m->table_size == table_size);
+    snprintf(key, 16, "key:%d", 99999);
+    ASSERT("[! churn]: key lost", map_get(m, key) != NULL);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests that deleting every key leaves no trace behind, all slots are empty
+ * again and the keys still present are always reachable
+ */
+static char *test_map_del_shift(void) {
+    map *m = map_create();
+    char key[16];
+    for (int i = 0; i < 150; i++) {
+        snprintf(key, 16, "key:%d", i);
+        map_put(m, key, key);
+    }
+    for (int i = 0; i < 150; i++) {
+        snprintf(key, 16, "key:%d", i);
+        ASSERT("[! del shift]: del didn't work as expected", map_del(m, key) == MAP_OK);
+        for (int j = i + 1; j < 150; j += 7) {
+            snprintf(key, 16, "key:%d", j);
+            ASSERT("[! del shift]: key lost after a delete", map_get(m, key) != NULL);
+        }
+    }
+    for (unsigned long i = 0; i < m->table_size; i++)
+        ASSERT("[! del shift]: slot left not empty", m->ctrl[i] == CTRL_EMPTY);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests the metadata of every key follows its entry when deletes shift the
+ * clusters back and rehashes move the entries to a new table
+ */
+static char *test_map_meta(void) {
+    map *m = map_create();
+    char key[16];
+    long base = current_timestamp() + 60000;
+    ASSERT("[! meta]: entries grew past half a cache line", sizeof(map_entry) == 32);
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, 16, "meta:%d", i);
+        map_put(m, key, key);
+        map_set_expire_hashed(m, key, KEY_HASH(key), base + i * 1000);
+        if (i % 3 == 0) {
+            snprintf(key, 16, "meta:%d", i / 2);
+            map_del(m, key);
+        }
+    }
+    int wrong = 0;
+    for (int i = 1500; i < 3000; i++) {
+        snprintf(key, 16, "meta:%d", i);
+        map_entry *e = map_get_entry(m, key);
+        if (!e || !e->has_expire_time
+                || map_entry_meta(m, e)->expire_time != base + i * 1000)
+            wrong++;
+    }
+    ASSERT("[! meta]: TTL lost while moving entries", wrong == 0);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests that a table emptied by deletes shrinks while keeping the keys left,
+ * and that compaction resizes it to fit them at once
+ */
+static char *test_map_shrink(void) {
+    map *m = map_create();
+    char key[16];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        map_put(m, key, key);
+    }
+    unsigned long grown = m->table_size;
+    for (int i = 0; i < 10000; i++) {
+        if (i % 50 == 0) continue;
+        snprintf(key, 16, "key:%d", i);
+        map_del(m, key);
+    }
+    while (map_rehash_step(m, 1024))
+        ;
+    ASSERT("[! shrink]: table didn't shrink", m->table_size < grown);
+    ASSERT("[! shrink]: wrong size after shrink", m->size == 200);
+    for (int i = 0; i < 10000; i += 50) {
+        snprintf(key, 16, "key:%d", i);
+        ASSERT("[! shrink]: key lost after shrink", map_get(m, key) != NULL);
+    }
+    for (int i = 0; i < 10000; i += 50) {
+        if (i % 200 == 0) continue;
+        snprintf(key, 16, "key:%d", i);
+        map_del(m, key);
+    }
+    map_compact(m);
+    ASSERT("[! shrink]: compaction left a migration running", m->old_entries == NULL);
+    ASSERT("[! shrink]: table not compacted", m->table_size == 256);
+    ASSERT("[! shrink]: key lost after compaction", map_get(m, "key:200") != NULL);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests that keys whose TTL elapsed are hidden right away and reclaimed by
+ * the active expiry scan, while the others are left untouched
+ */
+static char *test_map_expire(void) {
+    map *m = map_create();
+    char key[16];
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, 16, "key:%d", i);
+        map_put(m, key, key);
+        if (i % 2 == 0)
+            map_set_expire_hashed(m, key, KEY_HASH(key), 1);
+    }
+    map_put(m, "live", "value");
+    map_set_expire_hashed(m, "live", KEY_HASH("live"), current_timestamp() + 60000);
+    ASSERT("[! expire]: expired key still visible", map_get(m, "key:0") == NULL);
+    ASSERT("[! expire]: key without TTL lost", map_get(m, "key:1") != NULL);
+    ASSERT("[! expire]: key not expired yet lost", map_get(m, "live") != NULL);
+
+    unsigned long cursor = 0, sampled = 0, expired = 0;
+    for (int i = 0; i < 8; i++)
+        expired += map_expire_scan(m, &cursor, 64, &sampled);
+    ASSERT("[! expire]: expired keys not reclaimed", expired == 50);
+    ASSERT("[! expire]: wrong size after expiry", m->size == 51 && m->expires == 1);
+    ASSERT("[! expire]: live key lost by the scan", map_get(m, "live") != NULL);
+
+    map_put(m, "live", "again");
+    ASSERT("[! expire]: SET didn't clear the TTL", m->expires == 0);
+    map_release(m);
+    return 0;
+}
+
+
 /*
  * Tests the iteration of map_iterate2
  */
@@ -97,8 +328,8 @@ static char *test_map_iterate2(void) {
     char *val0 = "world";
     char *key1 = "this";
     char *val1 = "time";
-    map_put(m, strdup(key0), strdup(val0));
-    map_put(m, strdup(key1), strdup(val1));
+    map_put(m, key0, val0);
+    map_put(m, key1, val1);
     map_iterate2(m, destroy_map, NULL);
     char *v0 = (char *) map_get(m, key0);
     char *v1 = (char *) map_get(m, key1);
@@ -110,6 +341,709 @@ static char *test_map_iterate2(void) {
 }
 
 
+/*
+ * Tests lock-free reads, a read overlapping a write must be retried
+ */
+static char *test_map_read(void) {
+    map *m = map_create();
+    unsigned long seq = 0;
+    char *val = NULL;
+    map_put(m, "key", "value");
+    map_put(m, "gone", "value");
+    map_set_expire_hashed(m, "gone", KEY_HASH("gone"), 1);
+    ASSERT("[! read]: lock-free read failed",
+            map_read_hashed(m, "key", KEY_HASH("key"), &seq, 0, &val) == MAP_OK);
+    ASSERT("[! read]: wrong value copied", strcmp(val, "value") == 0);
+    free(val);
+    ASSERT("[! read]: missing key found",
+            map_read_hashed(m, "none", KEY_HASH("none"), &seq, 0, &val) == MAP_ERR);
+    ASSERT("[! read]: expired key not reported",
+            map_read_hashed(m, "gone", KEY_HASH("gone"), &seq, 0, &val) == MAP_EXPIRED);
+    seq = 1;
+    ASSERT("[! read]: read racing with a writer not retried",
+            map_read_hashed(m, "key", KEY_HASH("key"), &seq, 0, &val) == MAP_RETRY);
+    map_release(m);
+    return 0;
+}
+
+
+static int freed;
+
+static void count_free(void *ptr) {
+    freed++;
+    free(ptr);
+}
+
+
+/*
+ * Tests that retired memory outlives the epochs pinned before its retirement
+ */
+static char *test_epoch(void) {
+    freed = 0;
+    ASSERT("[! epoch]: enter failed", epoch_enter() == 0);
+    epoch_retire(malloc(16), count_free);
+    epoch_reclaim();
+    ASSERT("[! epoch]: memory freed while pinned", freed == 0);
+    epoch_exit();
+    epoch_barrier();
+    ASSERT("[! epoch]: memory not freed after exit", freed == 1);
+    return 0;
+}
+
+
+/*
+ * Tests the key hash against the reference xxHash64 values and the shard
+ * selection derived from it
+ */
+static char *test_key_hash(void) {
+    ASSERT("[! hash]: wrong hash of an empty key", xxh64("", 0, 0) == 0xEF46DB3751D8E999ULL);
+    ASSERT("[! hash]: wrong hash of a short key", xxh64("abc", 3, 0) == 0x44BC2CF5AD770999ULL);
+    store *s = store_create();
+    unsigned long hash = KEY_HASH("hello");
+    ASSERT("[! hash]: wrong shard for a key",
+            store_shard(s, hash) == &s->shards[(hash >> 48) % s->nshards]);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests insertion and lookup through the sharded store
+ */
+static char *test_store_put_get(void) {
+    store *s = store_create();
+    int status = store_put(s, "hello", KEY_HASH("hello"), "world");
+    ASSERT("[! store put]: put didn't work as expected", status == MAP_OK);
+    store_put(s, "hello", KEY_HASH("hello"), "WORLD");
+    char *ret = store_get(s, "hello", KEY_HASH("hello"));
+    ASSERT("[! store get]: put didn't update the value",
+            ret && strcmp(ret, "WORLD") == 0);
+    free(ret);
+    ASSERT("[! store get]: found a missing key", store_get(s, "nope", KEY_HASH("nope")) == NULL);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests that keys are spread over shards and can be deleted and flushed
+ */
+static char *test_store_del_flush(void) {
+    store *s = store_create();
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        store_put(s, key, KEY_HASH(key), "value");
+    }
+    ASSERT("[! store size]: wrong number of keys", store_size(s) == 1000);
+    int used = 0;
+    for (unsigned int i = 0; i < s->nshards; i++)
+        if (s->shards[i].map->size > 0) used++;
+    ASSERT("[! store shards]: keys not spread across shards", used == s->nshards);
+    ASSERT("[! store del]: del didn't work as expected",
+            store_del(s, "key:10", KEY_HASH("key:10")) == MAP_OK);
+    ASSERT("[! store del]: key still present", store_get(s, "key:10", KEY_HASH("key:10")) == NULL);
+    ASSERT("[! store flush]: flush failed", store_flush(s) == MAP_OK);
+    ASSERT("[! store flush]: keys still present", store_size(s) == 0);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests that a store expiry cycle reclaims stale keys across all shards
+ */
+static char *test_store_expire(void) {
+    store *s = store_create();
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        store_put(s, key, KEY_HASH(key), "value");
+        shard *sh = store_shard(s, KEY_HASH(key));
+        map_set_expire_hashed(sh->map, key, KEY_HASH(key), 1);
+    }
+    ASSERT("[! store expire]: expired key returned", store_get(s, "key:1", KEY_HASH("key:1")) == NULL);
+    ASSERT("[! store expire]: GET didn't reclaim the key", store_size(s) == 999);
+    store_expire_cycle(s, 1000000);
+    ASSERT("[! store expire]: keys left after a cycle", store_size(s) == 0);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests the memory limit: with noeviction writes are refused, with an LFU
+ * policy keys are evicted to stay under the limit and a hot key survives
+ */
+static char *test_store_evict(void) {
+    store *s = store_create();
+    char key[16], val[64];
+    memset(val, 'x', 63);
+    val[63] = '\0';
+    s->maxmemory = store_memory() + 512 * 1024;
+    store_put(s, "hot", KEY_HASH("hot"), "value");
+
+    s->policy = NOEVICTION;
+    int oom = 0;
+    for (int i = 0; i < 20000 && !oom; i++) {
+        snprintf(key, 16, "key:%d", i);
+        if (store_make_room(s) == STORE_OOM) oom = 1;
+        else store_put(s, key, KEY_HASH(key), val);
+    }
+    ASSERT("[! evict]: noeviction didn't refuse writes", oom == 1);
+
+    /* The hot key must already stand out once evictions start */
+    for (int i = 0; i < 100; i++)
+        free(store_get(s, "hot", KEY_HASH("hot")));
+    s->policy = ALLKEYS_LFU;
+    for (int i = 0; i < 50000; i++) {
+        snprintf(key, 16, "key:%d", i);
+        ASSERT("[! evict]: write refused", store_make_room(s) == MAP_OK);
+        store_put(s, key, KEY_HASH(key), val);
+        free(store_get(s, "hot", KEY_HASH("hot")));
+    }
+    ASSERT("[! evict]: no key evicted", s->evicted > 0);
+    ASSERT("[! evict]: memory limit exceeded",
+            store_memory() < s->maxmemory + 256 * 1024);
+    char *hot = store_get(s, "hot", KEY_HASH("hot"));
+    ASSERT("[! evict]: hot key evicted", hot != NULL);
+    free(hot);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests that the skiplist keeps its keys in order and seeks to the first one
+ * not lower than a key
+ */
+static char *test_skiplist(void) {
+    skiplist *sl = skiplist_create();
+    char key[16];
+    for (int i = 999; i >= 0; i--) {
+        snprintf(key, 16, "key:%03d", i);
+        ASSERT("[! skiplist]: insert failed", skiplist_insert(sl, key, strlen(key), i) == MAP_OK);
+    }
+    ASSERT("[! skiplist]: duplicate inserted", skiplist_insert(sl, "key:500", 7, 0) == MAP_ERR);
+    ASSERT("[! skiplist]: delete failed", skiplist_delete(sl, "key:500", 7) == MAP_OK);
+    ASSERT("[! skiplist]: missing key deleted", skiplist_delete(sl, "key:500", 7) == MAP_ERR);
+    ASSERT("[! skiplist]: wrong size", sl->size == 999);
+
+    skiplist_node *n = skiplist_seek(sl, "key:5", 5);
+    ASSERT("[! skiplist]: wrong seek", n && strcmp(skiplist_key(n), "key:501") == 0);
+    ASSERT("[! skiplist]: hash not kept", n->hash == 501);
+    int ordered = 1;
+    for (n = sl->head->next[0]; n && n->next[0]; n = n->next[0])
+        if (strcmp(skiplist_key(n), skiplist_key(n->next[0])) >= 0) ordered = 0;
+    ASSERT("[! skiplist]: keys not in order", ordered);
+    skiplist_release(sl);
+    return 0;
+}
+
+
+/*
+ * Tests range and prefix queries over the ordered index of every shard, keys
+ * deleted or expired are left out
+ */
+static char *test_store_keys(void) {
+    store *s = store_create();
+    char key[32];
+    unsigned long n;
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, 32, "user:%02d:name", i);
+        store_put(s, key, KEY_HASH(key), "x");
+    }
+    store_put(s, "other", KEY_HASH("other"), "x");
+    ASSERT("[! keys]: index not built", store_index(s, 1) == MAP_OK);
+    store_put(s, "user:100:name", KEY_HASH("user:100:name"), "x");
+    store_del(s, "user:11:name", KEY_HASH("user:11:name"));
+    shard *sh = store_shard(s, KEY_HASH("user:12:name"));
+    map_set_expire_hashed(sh->map, "user:12:name", KEY_HASH("user:12:name"), 1);
+
+    char **keys = store_keys(s, "user:1", NULL, "user:1", 0, &n);
+    ASSERT("[! keys]: wrong number of prefixed keys", n == 9);
+    ASSERT("[! keys]: prefixed keys not in order",
+            strcmp(keys[0], "user:100:name") == 0 && strcmp(keys[1], "user:10:name") == 0
+            && strcmp(keys[2], "user:13:name") == 0);
+    for (unsigned long i = 0; i < n; i++) free(keys[i]);
+    free(keys);
+
+    keys = store_keys(s, "user:20", "user:29:name", NULL, 3, &n);
+    ASSERT("[! keys]: range limit not applied", n == 3);
+    ASSERT("[! keys]: wrong range", strcmp(keys[0], "user:20:name") == 0
+            && strcmp(keys[2], "user:22:name") == 0);
+    for (unsigned long i = 0; i < n; i++) free(keys[i]);
+    free(keys);
+
+    store_flush(s);
+    store_put(s, "user:1", KEY_HASH("user:1"), "x");
+    keys = store_keys(s, "user:", NULL, "user:", 0, &n);
+    ASSERT("[! keys]: index lost after flush", n == 1);
+    free(keys[0]);
+    free(keys);
+    store_release(s);
+    return 0;
+}
+
+
+static int scan_count(void *arg, void *data) {
+    map_entry *e = data;
+    int *seen = arg;
+    seen[atoi((char *) e->key + 4)]++;
+    return MAP_OK;
+}
+
+
+/*
+ * Tests a scan of a map that grows and then shrinks midway reports every key
+ * present for the whole scan
+ */
+static char *test_map_scan(void) {
+    map *m = map_create();
+    char key[32];
+    int seen[8000] = {0};
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, 32, "key:%d", i);
+        map_put(m, key, "x");
+    }
+    unsigned long cursor = 0, calls = 0;
+    do {
+        cursor = map_scan(m, cursor, scan_count, seen);
+        if (++calls == 50) {
+            for (int i = 1000; i < 8000; i++) {
+                snprintf(key, 32, "key:%d", i);
+                map_put(m, key, "x");
+            }
+        } else if (calls == 5000) {
+            for (int i = 1000; i < 8000; i++) {
+                snprintf(key, 32, "key:%d", i);
+                map_del(m, key);
+            }
+        }
+    } while (cursor != 0);
+    int missing = 0;
+    for (int i = 0; i < 1000; i++)
+        if (seen[i] == 0) missing++;
+    ASSERT("[! scan]: keys missed across resizes", missing == 0);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests FLUSH and the delete of a very large value leave the release of the
+ * memory to the lazyfree threads
+ */
+static char *test_lazyfree(void) {
+    store *s = store_create();
+    char key[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, 32, "lazy:%d", i);
+        store_put(s, key, KEY_HASH(key), "value");
+    }
+    char *big = malloc(4 * SLAB_PAGE_SIZE);
+    memset(big, 'x', 4 * SLAB_PAGE_SIZE - 1);
+    big[4 * SLAB_PAGE_SIZE - 1] = '\0';
+    store_put(s, "big", KEY_HASH("big"), big);
+    free(big);
+    size_t before = slab_used();
+    ASSERT("[! lazyfree]: threads not started", lazyfree_start(2) == 0);
+    store_del(s, "big", KEY_HASH("big"));
+    epoch_barrier();
+    store_flush(s);
+    ASSERT("[! lazyfree]: keys left after flush", store_size(s) == 0);
+    lazyfree_wait();
+    ASSERT("[! lazyfree]: jobs still pending", lazyfree_pending() == 0);
+    ASSERT("[! lazyfree]: memory not released",
+            slab_used() + 4 * SLAB_PAGE_SIZE <= before);
+    lazyfree_stop();
+    store_release(s);
+    return 0;
+}
+
+
+static uint64_t key_version(store *s, const char *key) {
+    shard *sh = store_shard(s, KEY_HASH(key));
+    map_entry *e = map_get_entry_hashed(sh->map, key, KEY_HASH(key));
+    return e ? map_entry_meta(sh->map, e)->version : 0;
+}
+
+
+/*
+ * Tests CAS writes only over the version read, and versions never go back
+ */
+static char *test_store_cas(void) {
+    store *s = store_create();
+    ASSERT("[! cas]: missing key not created",
+            store_cas(s, "k", KEY_HASH("k"), 0, "a") == MAP_OK);
+    uint64_t v = key_version(s, "k");
+    ASSERT("[! cas]: create over an existing key",
+            store_cas(s, "k", KEY_HASH("k"), 0, "b") == MAP_MISMATCH);
+    ASSERT("[! cas]: write with the right version refused",
+            store_cas(s, "k", KEY_HASH("k"), v, "b") == MAP_OK);
+    ASSERT("[! cas]: version not bumped", key_version(s, "k") > v);
+    ASSERT("[! cas]: write with a stale version accepted",
+            store_cas(s, "k", KEY_HASH("k"), v, "c") == MAP_MISMATCH);
+    char *val = store_get(s, "k", KEY_HASH("k"));
+    ASSERT("[! cas]: wrong value", val && strcmp(val, "b") == 0);
+    free(val);
+    store_put(s, "n", KEY_HASH("n"), "1");
+    store_incr(s, "n", KEY_HASH("n"), 1);
+    v = key_version(s, "n");
+    store_incr(s, "n", KEY_HASH("n"), 1);
+    ASSERT("[! cas]: increment didn't bump the version", key_version(s, "n") > v);
+    v = key_version(s, "k");
+    store_del(s, "k", KEY_HASH("k"));
+    store_flush(s);
+    store_put(s, "k", KEY_HASH("k"), "d");
+    ASSERT("[! cas]: version reused after flush", key_version(s, "k") > v);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests tables large enough to be mapped on their own grow and shrink back,
+ * asking for reserved huge pages falls back when the system has none
+ */
+static char *test_map_large_table(void) {
+    map *m = map_create();
+    char key[32];
+    int missing = 0;
+    map_huge_pages(1);
+    for (int i = 0; i < 100000; i++) {
+        snprintf(key, 32, "large:%d", i);
+        map_put(m, key, "x");
+    }
+    map_compact(m);
+    ASSERT("[! large]: table not grown", m->table_size >= 131072);
+    for (int i = 0; i < 100000; i++) {
+        snprintf(key, 32, "large:%d", i);
+        if (!map_get(m, key)) missing++;
+    }
+    ASSERT("[! large]: keys lost in a mapped table", missing == 0);
+    for (int i = 0; i < 99990; i++) {
+        snprintf(key, 32, "large:%d", i);
+        map_del(m, key);
+    }
+    map_compact(m);
+    ASSERT("[! large]: table not shrunk", m->table_size == 256);
+    ASSERT("[! large]: key lost after shrinking", map_get(m, "large:99995") != NULL);
+    map_huge_pages(0);
+    map_release(m);
+    return 0;
+}
+
+
+/*
+ * Tests workers are spread across the NUMA nodes, or that NUMA placement is
+ * a no-op on a single node machine
+ */
+static char *test_numa(void) {
+    int nodes = numa_init();
+    ASSERT("[! numa]: a single node enabled NUMA mode", nodes == 0 || nodes >= 2);
+    if (nodes == 0) {
+        ASSERT("[! numa]: worker pinned on a single node", numa_worker_cpu(0) == -1);
+        ASSERT("[! numa]: memory bound on a single node", numa_bind(NULL, 0, 0) == -1);
+    } else {
+        for (int i = 0; i < 2 * nodes; i++)
+            ASSERT("[! numa]: worker on the wrong node",
+                    numa_node_of_cpu(numa_worker_cpu(i)) == i % nodes);
+    }
+    return 0;
+}
+
+
+/*
+ * Tests requests are cut out of the input of a connection whatever the way
+ * they are split, and the buffer shrinks back after a large one
+ */
+static char *test_session(void) {
+    int fds[2];
+    ASSERT("[! session]: table not created", session_init() == 0);
+    ASSERT("[! session]: socketpair failed", socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    session *s = session_get(fds[0]);
+    ASSERT("[! session]: session not created", s && session_get(fds[0]) == s);
+
+    const char *input = "set a 1\r\nget a\nget";
+    write(fds[1], input, strlen(input));
+    ASSERT("[! session]: nothing read", session_fill(s, fds[0]) == (int) strlen(input));
+    ASSERT("[! session]: first request", strcmp(session_line(s), "set a 1") == 0);
+    ASSERT("[! session]: second request", strcmp(session_line(s), "get a") == 0);
+    ASSERT("[! session]: partial request cut", session_line(s) == NULL);
+    session_compact(s);
+    write(fds[1], " b\r\n", strlen(" b\r\n"));
+    session_fill(s, fds[0]);
+    ASSERT("[! session]: request split across reads",
+            strcmp(session_line(s), "get b") == 0);
+    ASSERT("[! session]: nothing should be left", session_line(s) == NULL);
+    session_compact(s);
+
+    size_t big = 4 * SESSION_BUF_IDLE_MAX;
+    char *burst = malloc(big);
+    memset(burst, 'x', big);
+    burst[big - 1] = '\n';
+    size_t sent = 0, line_len = 0;
+    while (line_len == 0) {
+        if (sent < big) {
+            ssize_t n = write(fds[1], burst + sent, big - sent);
+            if (n > 0) sent += n;
+        }
+        session_fill(s, fds[0]);
+        char *line = session_line(s);
+        if (line) line_len = strlen(line);
+        else session_compact(s);
+    }
+    ASSERT("[! session]: large request corrupted", line_len == big - 1);
+    session_compact(s);
+    ASSERT("[! session]: buffer not released after a burst", s->cap == 0);
+
+    session_close(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    free(burst);
+    return 0;
+}
+
+
+/*
+ * Tests replies are written in order, resuming where a full socket stopped
+ */
+static char *test_session_flush(void) {
+    int fds[2];
+    ASSERT("[! flush]: socketpair failed", socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    session *s = session_get(fds[0]);
+    session_acquire(s);
+    int replies = 20000;
+    for (int i = 0; i < replies; i++) {
+        peer_t *p = malloc(sizeof(peer_t));
+        p->fd = fds[0];
+        p->alloc = 1;
+        p->tocli = 1;
+        p->data = malloc(16);
+        p->size = snprintf(p->data, 16, "%d\r\n", i);
+        session_push(s, p, -1);
+    }
+    ASSERT("[! flush]: socket full not reported", session_flush(s) == 1);
+
+    char buf[4096], line[16];
+    int next = 0, len = 0, in_order = 1, ret;
+    do {
+        ret = session_flush(s);
+        ssize_t n = read(fds[1], buf, sizeof(buf));
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] != '\n') {
+                line[len++] = buf[i];
+                continue;
+            }
+            line[len - 1] = '\0';
+            if (atoi(line) != next++) in_order = 0;
+            len = 0;
+        }
+    } while (next < replies);
+    ASSERT("[! flush]: replies left", ret == 0 && s->out_head == NULL);
+    ASSERT("[! flush]: replies out of order", in_order);
+
+    session_close(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+
+/*
+ * Tests a ring receives into its provided buffers until the peer closes,
+ * and sends gathered messages, if the kernel supports io_uring at all
+ */
+static char *test_uring(void) {
+    uring r;
+    if (uring_init(&r) == -1)
+        return 0;
+    int fds[2];
+    ASSERT("[! uring]: socketpair failed", socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    ASSERT("[! uring]: recv not queued", uring_recv(&r, fds[0], 1) == 0);
+
+    char got[16] = {0};
+    size_t len = 0;
+    int more = 1;
+    ASSERT("[! uring]: write failed", write(fds[1], "hello", 5) == 5);
+    ASSERT("[! uring]: write failed", write(fds[1], "world", 5) == 5);
+    while (len < 10) {
+        ASSERT("[! uring]: wait failed", uring_wait(&r) == 0);
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&r)) != NULL) {
+            char *buf = uring_buffer(&r, cqe);
+            ASSERT("[! uring]: recv failed", cqe->res > 0 && buf && len + cqe->res <= 10);
+            memcpy(got + len, buf, cqe->res);
+            len += cqe->res;
+            more &= (cqe->flags & IORING_CQE_F_MORE) != 0;
+            uring_recycle(&r, cqe);
+            uring_cqe_seen(&r);
+        }
+    }
+    ASSERT("[! uring]: wrong data received", strcmp(got, "helloworld") == 0);
+    ASSERT("[! uring]: recv not multishot", more);
+
+    struct iovec iov[2] = { { "ab", 2 }, { "cd", 2 } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    ASSERT("[! uring]: send not queued", uring_sendmsg(&r, fds[0], &msg, 2) == 0);
+    ASSERT("[! uring]: wait failed", uring_wait(&r) == 0);
+    struct io_uring_cqe *cqe = uring_cqe(&r);
+    ASSERT("[! uring]: send failed", cqe && cqe->user_data == 2 && cqe->res == 4);
+    uring_cqe_seen(&r);
+    ASSERT("[! uring]: wrong data sent", read(fds[1], got, 4) == 4 && memcmp(got, "abcd", 4) == 0);
+
+    close(fds[1]);
+    ASSERT("[! uring]: wait failed", uring_wait(&r) == 0);
+    cqe = uring_cqe(&r);
+    ASSERT("[! uring]: close not reported",
+            cqe && cqe->res == 0 && !(cqe->flags & IORING_CQE_F_MORE));
+    uring_cqe_seen(&r);
+
+    close(fds[0]);
+    uring_release(&r);
+    return 0;
+}
+
+
+/*
+ * Tests requests are split in place on any whitespace, the rest of a request
+ * is kept as is, and every command is found whatever the case of its name
+ */
+static char *test_request(void) {
+    char line[] = "SET\t key  a value ";
+    request r = { line };
+    size_t len;
+    char *name = request_next(&r, &len);
+    ASSERT("[! request]: wrong command", name == line && len == 3 && strcmp(name, "SET") == 0);
+    char *key = request_next(&r, &len);
+    ASSERT("[! request]: wrong key", key && len == 3 && strcmp(key, "key") == 0);
+    ASSERT("[! request]: wrong rest", strcmp(request_rest(&r), " a value ") == 0);
+    ASSERT("[! request]: wrong argument", strcmp(request_next(&r, NULL), "a") == 0);
+    ASSERT("[! request]: wrong argument", strcmp(request_next(&r, NULL), "value") == 0);
+    ASSERT("[! request]: argument past the end", request_next(&r, NULL) == NULL);
+    ASSERT("[! request]: rest past the end", request_rest(&r) == NULL);
+
+    const char *names[] = { "set", "GET", "Incf", "info", "prepend", "scan" };
+    for (int i = 0; i < 6; i++) {
+        const command *cmd = command_lookup(names[i], strlen(names[i]));
+        ASSERT("[! request]: command not found",
+                cmd && strcasecmp(cmd->name, names[i]) == 0);
+    }
+    ASSERT("[! request]: name not bounded by its length", command_lookup("setex", 3)
+            && strcmp(command_lookup("setex", 3)->name, "set") == 0);
+    ASSERT("[! request]: unknown command found", command_lookup("inco", 4) == NULL);
+    ASSERT("[! request]: unknown command found", command_lookup("quit", 4) == NULL);
+    ASSERT("[! request]: empty command found", command_lookup("", 0) == NULL);
+    return 0;
+}
+
+
+/*
+ * Tests SCAN walks the whole store with MATCH filtering
+ */
+static char *test_store_scan(void) {
+    store *s = store_create();
+    char key[32], **keys;
+    unsigned long cursor = 0, n, found = 0, calls = 0;
+    for (int i = 0; i < 500; i++) {
+        snprintf(key, 32, i % 5 ? "item:%d" : "user:%d", i);
+        store_put(s, key, KEY_HASH(key), "x");
+    }
+    do {
+        cursor = store_scan(s, cursor, "user:*", 10, &keys, &n);
+        for (unsigned long i = 0; i < n; i++) {
+            if (strncmp(keys[i], "user:", 5) == 0) found++;
+            free(keys[i]);
+        }
+        free(keys);
+        calls++;
+    } while (cursor != 0);
+    ASSERT("[! scan]: wrong number of matching keys", found == 100);
+    ASSERT("[! scan]: scan done in a single call", calls > 1);
+    ASSERT("[! glob]: star", glob_match("user:*:name", "user:12:name"));
+    ASSERT("[! glob]: question mark", glob_match("a?c", "abc") && !glob_match("a?c", "ac"));
+    ASSERT("[! glob]: class", glob_match("k[0-3x]", "kx") && !glob_match("k[^0-3]", "k2"));
+    ASSERT("[! glob]: escape", glob_match("a\\*", "a*") && !glob_match("a\\*", "ab"));
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests counters, stored in binary from the first increment and rendered as
+ * text when read
+ */
+static char *test_store_incr(void) {
+    store *s = store_create();
+    char *val;
+    store_put(s, "n", KEY_HASH("n"), "10");
+    store_put(s, "big", KEY_HASH("big"), "9223372036854775807");
+    store_put(s, "text", KEY_HASH("text"), "abc");
+    ASSERT("[! incr]: increment failed", store_incr(s, "n", KEY_HASH("n"), 5) == MAP_OK);
+    ASSERT("[! incr]: increment failed", store_incr(s, "n", KEY_HASH("n"), -20) == MAP_OK);
+    shard *sh = store_shard(s, KEY_HASH("n"));
+    ASSERT("[! incr]: counter not stored as integer",
+            map_get_entry_hashed(sh->map, "n", KEY_HASH("n"))->type == VAL_INT);
+    val = store_get(s, "n", KEY_HASH("n"));
+    ASSERT("[! incr]: wrong counter value", val && strcmp(val, "-5") == 0);
+    free(val);
+    ASSERT("[! incr]: text incremented", store_incr(s, "text", KEY_HASH("text"), 1) == MAP_ERR);
+    ASSERT("[! incr]: missing key incremented", store_incr(s, "none", KEY_HASH("none"), 1) == MAP_ERR);
+    ASSERT("[! incr]: overflow not detected", store_incr(s, "big", KEY_HASH("big"), 1) == MAP_ERR);
+
+    ASSERT("[! incr]: float increment failed", store_incrf(s, "n", KEY_HASH("n"), 0.25) == MAP_OK);
+    val = store_get(s, "n", KEY_HASH("n"));
+    ASSERT("[! incr]: wrong float value", val && strcmp(val, "-4.75") == 0);
+    free(val);
+    store_put(s, "n", KEY_HASH("n"), "plain");
+    val = store_get(s, "n", KEY_HASH("n"));
+    ASSERT("[! incr]: number not replaced by text", val && strcmp(val, "plain") == 0);
+    free(val);
+    store_release(s);
+    return 0;
+}
+
+
+/*
+ * Tests slab allocation, chunks are rounded up to their class and freed ones
+ * are reused by the next allocation of the same class, pages left empty are
+ * given back by a trim
+ */
+static char *test_slab_alloc(void) {
+    char *a = slab_alloc(20);
+    ASSERT("[! slab]: alloc failed", a != NULL);
+    ASSERT("[! slab]: chunk too small", slab_usable_size(a) >= 20);
+    slab_free(a);
+    char *b = slab_alloc(slab_usable_size(a));
+    ASSERT("[! slab]: freed chunk not reused", a == b);
+    slab_free(b);
+
+    char *large = slab_alloc(SLAB_MAX_CHUNK + 1);
+    ASSERT("[! slab]: large alloc failed", large != NULL);
+    memset(large, 'x', SLAB_MAX_CHUNK + 1);
+    ASSERT("[! slab]: large chunk too small",
+            slab_usable_size(large) >= SLAB_MAX_CHUNK + 1);
+    slab_free(large);
+
+    slab_class_stats stats[SLAB_MAX_CLASSES];
+    ASSERT("[! slab]: no class in use", slab_stats(stats, SLAB_MAX_CLASSES) > 0);
+    ASSERT("[! slab]: no memory reported", slab_memory() >= SLAB_PAGE_SIZE);
+
+    void *chunks[1024];
+    for (int i = 0; i < 1024; i++)
+        chunks[i] = slab_alloc(3000);
+    size_t mapped = slab_memory();
+    for (int i = 0; i < 1024; i++)
+        slab_free(chunks[i]);
+    ASSERT("[! slab]: empty pages not released", slab_trim() >= 2 * SLAB_PAGE_SIZE);
+    ASSERT("[! slab]: memory not given back", slab_memory() < mapped);
+    ASSERT("[! slab]: trimmed class unusable", (b = slab_alloc(3000)) != NULL);
+    slab_free(b);
+    return 0;
+}
+
+
 /*
  * Tests the creation of a list
  */
@@ -169,7 +1103,35 @@ static char *all_tests() {
     RUN_TEST(test_map_put);
     RUN_TEST(test_map_get);
     RUN_TEST(test_map_del);
+    RUN_TEST(test_map_embedded);
+    RUN_TEST(test_map_rehash);
+    RUN_TEST(test_map_churn);
+    RUN_TEST(test_map_del_shift);
+    RUN_TEST(test_map_meta);
+    RUN_TEST(test_map_shrink);
+    RUN_TEST(test_map_expire);
     RUN_TEST(test_map_iterate2);
+    RUN_TEST(test_map_read);
+    RUN_TEST(test_epoch);
+    RUN_TEST(test_key_hash);
+    RUN_TEST(test_store_put_get);
+    RUN_TEST(test_store_del_flush);
+    RUN_TEST(test_store_expire);
+    RUN_TEST(test_store_evict);
+    RUN_TEST(test_store_incr);
+    RUN_TEST(test_skiplist);
+    RUN_TEST(test_store_keys);
+    RUN_TEST(test_map_scan);
+    RUN_TEST(test_store_scan);
+    RUN_TEST(test_lazyfree);
+    RUN_TEST(test_store_cas);
+    RUN_TEST(test_map_large_table);
+    RUN_TEST(test_numa);
+    RUN_TEST(test_session);
+    RUN_TEST(test_session_flush);
+    RUN_TEST(test_uring);
+    RUN_TEST(test_request);
+    RUN_TEST(test_slab_alloc);
     RUN_TEST(test_list_create);
     RUN_TEST(test_list_release);
     RUN_TEST(test_list_head_insert);